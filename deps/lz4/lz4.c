@@ -0,0 +1,271 @@
+/* LZ4 block format codec, see lz4.h.
+ *
+ * The compressor is the greedy single pass of the reference "fast" mode:
+ * a hash table maps every 4 bytes sequence to its last position, a match
+ * is taken as soon as one is found, and after a run of misses positions
+ * are skipped faster and faster, so that data that doesn't compress costs
+ * little time. */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lz4.h"
+
+#define MINMATCH 4
+#define LASTLITERALS 5 /* The last bytes of the input are literals */
+#define MFLIMIT 12 /* The last match starts before the last MFLIMIT bytes */
+#define MIN_INPUT_SIZE (MFLIMIT + 1) /* Smaller inputs are all literals */
+#define MAX_DISTANCE 65535
+#define ML_BITS 4
+#define ML_MASK ((1U << ML_BITS) - 1)
+#define RUN_MASK ML_MASK
+#define SKIP_TRIGGER 6 /* Misses before the search step grows */
+
+#define HASH_LOG 12
+#define HASH_SIZE (1 << HASH_LOG)
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t read64(const unsigned char *p) {
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash32(uint32_t seq) {
+    return (seq * 2654435761U) >> (32 - HASH_LOG);
+}
+
+/* Length of the common prefix of 'ip' and 'ref', not going past 'limit'. */
+static size_t matchLength(const unsigned char *ip, const unsigned char *ref,
+        const unsigned char *limit) {
+    const unsigned char *start = ip;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (ip + sizeof(uint64_t) <= limit) {
+        uint64_t diff = read64(ip) ^ read64(ref);
+
+        if (diff)
+            return ip - start + (__builtin_ctzll(diff) >> 3);
+        ip += sizeof(uint64_t);
+        ref += sizeof(uint64_t);
+    }
+#endif
+    while (ip < limit && *ip == *ref) {
+        ip++;
+        ref++;
+    }
+    return ip - start;
+}
+
+/* Write the extension bytes of a length of at least 15. */
+static unsigned char *writeLength(unsigned char *op, size_t len) {
+    for (len -= RUN_MASK; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = (unsigned char) len;
+    return op;
+}
+
+int LZ4_compressBound(int inputSize) {
+    return LZ4_COMPRESSBOUND(inputSize);
+}
+
+int LZ4_compress_default(const char *src, char *dst, int srcSize,
+        int dstCapacity) {
+    uint32_t table[HASH_SIZE];
+    const unsigned char *base = (const unsigned char *) src;
+    const unsigned char *ip = base, *anchor = base, *ref;
+    const unsigned char *iend = base + srcSize;
+    const unsigned char *mflimit = iend - MFLIMIT;
+    const unsigned char *matchlimit = iend - LASTLITERALS;
+    unsigned char *op = (unsigned char *) dst, *token;
+    unsigned char *oend = op + dstCapacity;
+    size_t litlen, mlen;
+    uint32_t h;
+    unsigned attempts;
+
+    if (srcSize < 0 || srcSize > LZ4_MAX_INPUT_SIZE || dstCapacity < 1)
+        return 0;
+    if (srcSize < MIN_INPUT_SIZE)
+        goto last_literals;
+    memset(table, 0, sizeof(table));
+
+    /* Position 0 is in the table from the start, as the zeroed entries */
+    ip++;
+    for (;;) {
+        /* Find a match, with a step growing with the misses */
+        attempts = 1U << SKIP_TRIGGER;
+        for (;;) {
+            if (ip > mflimit)
+                goto last_literals;
+            h = hash32(read32(ip));
+            ref = base + table[h];
+            table[h] = (uint32_t) (ip - base);
+            if (ref < ip && ip - ref <= MAX_DISTANCE &&
+                    read32(ref) == read32(ip))
+                break;
+            ip += attempts++ >> SKIP_TRIGGER;
+        }
+
+        /* Extend the match backwards over the pending literals */
+        while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+            ip--;
+            ref--;
+        }
+
+        /* Literals, with room for the offset and the next token */
+        litlen = ip - anchor;
+        if ((size_t) (oend - op) < 1 + litlen / 255 + 1 + litlen + 2 + 1)
+            return 0;
+        token = op++;
+        if (litlen >= RUN_MASK) {
+            *token = RUN_MASK << ML_BITS;
+            op = writeLength(op, litlen);
+        } else {
+            *token = (unsigned char) (litlen << ML_BITS);
+        }
+        memcpy(op, anchor, litlen);
+        op += litlen;
+
+        for (;;) {
+            /* Offset and match length */
+            op[0] = (unsigned char) (ip - ref);
+            op[1] = (unsigned char) ((ip - ref) >> 8);
+            op += 2;
+            mlen = matchLength(ip + MINMATCH, ref + MINMATCH, matchlimit);
+            ip += MINMATCH + mlen;
+            if (mlen >= ML_MASK) {
+                if ((size_t) (oend - op) < mlen / 255 + 1 + 1)
+                    return 0;
+                *token |= ML_MASK;
+                op = writeLength(op, mlen);
+            } else {
+                *token |= (unsigned char) mlen;
+            }
+            anchor = ip;
+            if (ip > mflimit)
+                goto last_literals;
+
+            /* Index a position inside the match, then try a match right
+             * at the current position, with no literals */
+            table[hash32(read32(ip - 2))] = (uint32_t) (ip - 2 - base);
+            h = hash32(read32(ip));
+            ref = base + table[h];
+            table[h] = (uint32_t) (ip - base);
+            if (!(ref < ip && ip - ref <= MAX_DISTANCE &&
+                    read32(ref) == read32(ip)))
+                break;
+            if (oend - op < 1 + 2 + 1)
+                return 0;
+            token = op++;
+            *token = 0;
+        }
+        ip++;
+    }
+
+last_literals:
+    litlen = iend - anchor;
+    if ((size_t) (oend - op) < 1 + (litlen + 255 - RUN_MASK) / 255 + litlen)
+        return 0;
+    token = op++;
+    if (litlen >= RUN_MASK) {
+        *token = RUN_MASK << ML_BITS;
+        op = writeLength(op, litlen);
+    } else {
+        *token = (unsigned char) (litlen << ML_BITS);
+    }
+    memcpy(op, anchor, litlen);
+    op += litlen;
+    return (int) (op - (unsigned char *) dst);
+}
+
+/* Read the extension bytes of a length of 15. Returns 0 if the input ends
+ * before the length does. */
+static int readLength(const unsigned char **ip, const unsigned char *iend,
+        size_t *len) {
+    unsigned s;
+
+    do {
+        if (*ip >= iend)
+            return 0;
+        s = *(*ip)++;
+        *len += s;
+    } while (s == 255);
+    return 1;
+}
+
+int LZ4_decompress_safe(const char *src, char *dst, int compressedSize,
+        int dstCapacity) {
+    const unsigned char *ip = (const unsigned char *) src;
+    const unsigned char *iend = ip + compressedSize;
+    unsigned char *op = (unsigned char *) dst, *base = op;
+    unsigned char *oend = op + dstCapacity;
+    const unsigned char *match;
+    size_t len, offset;
+    unsigned token;
+
+    if (compressedSize <= 0 || dstCapacity < 0)
+        return -1;
+    for (;;) {
+        if (ip >= iend)
+            return -1;
+        token = *ip++;
+
+        /* Literals */
+        len = token >> ML_BITS;
+        if (len == RUN_MASK && !readLength(&ip, iend, &len))
+            return -1;
+        if (len > (size_t) (iend - ip) || len > (size_t) (oend - op))
+            return -1;
+        /* Short runs are copied with a fixed size, when there is room */
+        if (len <= 16 && iend - ip >= 16 && oend - op >= 16)
+            memcpy(op, ip, 16);
+        else
+            memcpy(op, ip, len);
+        op += len;
+        ip += len;
+        if (ip == iend)
+            break; /* The last sequence has no match */
+
+        /* Match */
+        if (iend - ip < 2)
+            return -1;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t) (op - base))
+            return -1;
+        len = token & ML_MASK;
+        if (len == ML_MASK && !readLength(&ip, iend, &len))
+            return -1;
+        len += MINMATCH;
+        if (len > (size_t) (oend - op))
+            return -1;
+        match = op - offset;
+        if (offset >= 8 && (size_t) (oend - op) >= len + 8) {
+            /* Copy 8 bytes at a time, possibly past the end of the match:
+             * the extra bytes are overwritten by the next sequence */
+            unsigned char *cpy = op + len;
+
+            do {
+                memcpy(op, match, 8);
+                op += 8;
+                match += 8;
+            } while (op < cpy);
+            op = cpy;
+        } else if (offset >= len) {
+            memcpy(op, match, len);
+            op += len;
+        } else {
+            /* Overlapping copy, repeating the last 'offset' bytes */
+            while (len--)
+                *op++ = *match++;
+        }
+    }
+    return (int) (op - base);
+}
@@ -0,0 +1,42 @@
+/* A small implementation of the LZ4 block format.
+ *
+ * Only the block API is provided, with the same names and semantics of the
+ * reference library (https://github.com/lz4/lz4), so the two can be
+ * swapped: blocks compressed by either one are decompressed by the other.
+ *
+ * A block is a sequence of (literals, match) pairs. Every sequence starts
+ * with a token byte holding the number of literals and the match length
+ * minus 4, 4 bits each, extended with further bytes when they are 15:
+ *
+ *   token | literal length+ | literals | offset (2 bytes LE) | match length+
+ *
+ * The last sequence only has literals: the last 5 bytes of the input are
+ * always literals, and the last match starts at least 12 bytes before the
+ * end of the block. */
+
+#ifndef __LZ4_H
+#define __LZ4_H
+
+#define LZ4_MAX_INPUT_SIZE 0x7E000000 /* 2 113 929 216 bytes */
+#define LZ4_COMPRESSBOUND(isize) ((unsigned) (isize) > \
+		(unsigned) LZ4_MAX_INPUT_SIZE ? 0 : (isize) + ((isize) / 255) + 16)
+
+/* Return the maximum size of the compressed block of 'inputSize' bytes, 0
+ * if the input is too large to be compressed. */
+int LZ4_compressBound(int inputSize);
+
+/* Compress 'srcSize' bytes from 'src' into 'dst', of 'dstCapacity' bytes.
+ * Returns the size of the compressed block, or 0 if it doesn't fit in
+ * 'dst': passing a capacity smaller than the input is a cheap way to give
+ * up on data that doesn't compress enough. */
+int LZ4_compress_default(const char *src, char *dst, int srcSize,
+		int dstCapacity);
+
+/* Decompress a block of 'compressedSize' bytes into 'dst', of 'dstCapacity'
+ * bytes. Returns the decompressed size, or a negative number if the block is
+ * malformed or doesn't fit in 'dst'. The input is never read, nor the output
+ * written, out of bounds, whatever the content of the block. */
+int LZ4_decompress_safe(const char *src, char *dst, int compressedSize,
+		int dstCapacity);
+
+#endif /* __LZ4_H */
@@ -0,0 +1,67 @@
+/* CRC-64 with the Jones polynomial, as used by the Redis RDB format:
+ * reflected input and output, initial value and final xor of 0, so that
+ * crc64(0, "123456789", 9) is 0xe9c6d914c4b8d9ca.
+ *
+ * The checksum is computed 8 bytes at a time ("slicing by 8"), with eight
+ * tables of 256 entries built at the first call: every table gives the
+ * contribution of a byte followed by 0 to 7 more bytes. */
+
+#include "fmacros.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#include "crc64.h"
+
+#define CRC64_POLY 0x95ac9329ac4bc9b5ULL /* 0xad93d23594c935a9 reflected */
+
+static uint64_t crc64_table[8][256];
+static pthread_once_t crc64_once = PTHREAD_ONCE_INIT;
+
+static void crc64Init(void) {
+	uint64_t crc;
+	int j, k;
+
+	for (j = 0; j < 256; j++) {
+		crc = j;
+		for (k = 0; k < 8; k++)
+			crc = crc & 1 ? (crc >> 1) ^ CRC64_POLY : crc >> 1;
+		crc64_table[0][j] = crc;
+	}
+	for (j = 0; j < 256; j++) {
+		crc = crc64_table[0][j];
+		for (k = 1; k < 8; k++) {
+			crc = crc64_table[0][crc & 0xff] ^ (crc >> 8);
+			crc64_table[k][j] = crc;
+		}
+	}
+}
+
+/* Return the checksum of 'crc', the checksum of the bytes before, followed
+ * by the 'l' bytes at 's'. */
+uint64_t crc64(uint64_t crc, const unsigned char *s, size_t l) {
+	uint64_t v;
+
+	pthread_once(&crc64_once, crc64Init);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	while (l >= 8) {
+		memcpy(&v, s, sizeof(v));
+		v ^= crc;
+		crc = crc64_table[7][v & 0xff] ^
+				crc64_table[6][(v >> 8) & 0xff] ^
+				crc64_table[5][(v >> 16) & 0xff] ^
+				crc64_table[4][(v >> 24) & 0xff] ^
+				crc64_table[3][(v >> 32) & 0xff] ^
+				crc64_table[2][(v >> 40) & 0xff] ^
+				crc64_table[1][(v >> 48) & 0xff] ^
+				crc64_table[0][v >> 56];
+		s += 8;
+		l -= 8;
+	}
+#else
+	(void) v;
+#endif
+	while (l--)
+		crc = crc64_table[0][(crc ^ *s++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
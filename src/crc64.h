@@ -0,0 +1,9 @@
+#ifndef __CRC64_H
+#define __CRC64_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint64_t crc64(uint64_t crc, const unsigned char *s, size_t l);
+
+#endif /* __CRC64_H */
@@ -1,42 +1,397 @@
+#include "fmacros.h"
 #include "db.h"
+#include "epoch.h"
+#include "lz4.h"
 
-value_t *createValue(unsigned encoding, void *p) {
-	value_t *val = zmalloc(sizeof(*val));
-	val->encoding = encoding;
-	val->ver = 0;
-	val->ptr = p;
-	return val;
+#include <sys/time.h>
+#include <time.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* Return the UNIX time in microseconds */
+long long ustime(void) {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return ((long long) tv.tv_sec) * 1000000 + tv.tv_usec;
 }
 
-value_t *createValueFromLongLong(long long v) {
-	value_t *val;
-	if (v >= LONG_MIN && v <= LONG_MAX) {
-		val = createValue(ENCODING_INT, NULL);
-		val->ptr = (void*) ((long) v);
-	} else {
-		val = createValue(ENCODING_RAW, sdsfromlonglong(v));
+/* Return the UNIX time in milliseconds */
+mstime_t mstime(void) {
+	return ustime() / 1000;
+}
+
+/* Return a monotonic time in nanoseconds, to time short operations. */
+static long long nstime(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Reading the time for every lookup of a volatile key is measurable on the
+ * get() path, so TTLs are checked against cachedMstime(). When the clock is
+ * not precise it returns the time stored by the last updateCachedTime(),
+ * so whoever calls setPreciseClock(0) must also refresh the time every
+ * millisecond or so (mdb.c does it from its clock thread).
+ *
+ * The clock is precise by default: cachedMstime() is just mstime(). */
+static mstime_t cached_mstime = 0;
+static int precise_clock = 1;
+
+void updateCachedTime(void) {
+	__atomic_store_n(&cached_mstime, mstime(), __ATOMIC_RELAXED);
+}
+
+void setPreciseClock(int precise) {
+	if (!precise)
+		updateCachedTime();
+	__atomic_store_n(&precise_clock, precise, __ATOMIC_RELAXED);
+}
+
+mstime_t cachedMstime(void) {
+	if (__atomic_load_n(&precise_clock, __ATOMIC_RELAXED))
+		return mstime();
+	return __atomic_load_n(&cached_mstime, __ATOMIC_RELAXED);
+}
+
+/*-----------------------------------------------------------------------------
+ * Items and values
+ *----------------------------------------------------------------------------*/
+
+/* Build an sds string with the content of 's' at 'buf', that must have room
+ * for at least sizeof(struct sdshdr)+len+1 bytes. */
+static sds embedSds(char *buf, const char *s, size_t len) {
+	struct sdshdr *sh = (struct sdshdr*) buf;
+
+	sh->len = len;
+	sh->free = 0;
+	memcpy(sh->buf, s, len);
+	sh->buf[len] = '\0';
+	return sh->buf;
+}
+
+/* Return true if the key is padded to ITEM_INLINE_KEY_LEN bytes. */
+static inline int keyIsInline(const sds key) {
+	return sdslen(key) + sdsavail(key) == ITEM_INLINE_KEY_LEN;
+}
+
+/* Build the key of an item at 'buf', padding it if short enough. Returns
+ * the bytes used. */
+static size_t embedKey(char *buf, const char *s, size_t len) {
+	if (len > ITEM_INLINE_KEY_LEN) {
+		embedSds(buf, s, len);
+		return sizeof(struct sdshdr) + len + 1;
 	}
-	return val;
+	memset(buf, 0, ITEM_INLINE_KEY_SIZE);
+	embedSds(buf, s, len);
+	((struct sdshdr*) buf)->free = ITEM_INLINE_KEY_LEN - len;
+	return ITEM_INLINE_KEY_SIZE;
 }
 
-value_t *createValueFromStr(void *s, size_t len) {
-	long v;
-	value_t *val;
-	// first we try to encode the string as a long.
-	if (len > 21 || !string2l(s, len, &v)) {
-		val = createValue(ENCODING_RAW, sdsnewlen(s, len));
+/* The functions of this file take borrowed keys, a pointer and a length.
+ * The keyspace dict compares sds keys, so the key is copied in the layout
+ * of the item keys, padding included, in a buffer on the stack of the
+ * caller: lookups and deletes do not allocate. Only keys longer than
+ * KEY_STACK_LEN, unusual for a cache, are copied to the heap. */
+typedef struct keyBuf {
+	sds key;
+	char buf[sizeof(struct sdshdr) + KEY_STACK_LEN + 1];
+} keyBuf;
+
+static sds keyBufInit(keyBuf *kb, const char *k, size_t len) {
+	char *buf = kb->buf;
+
+	if (len > KEY_STACK_LEN)
+		buf = zmalloc(sizeof(struct sdshdr) + len + 1);
+	embedKey(buf, k, len);
+	kb->key = buf + sizeof(struct sdshdr);
+	return kb->key;
+}
+
+static void keyBufRelease(keyBuf *kb) {
+	if (kb->key != kb->buf + sizeof(struct sdshdr))
+		zfree(kb->key - sizeof(struct sdshdr));
+}
+
+/* Bytes needed by an item with a key of 'keylen' bytes and no value. */
+static size_t itemKeySize(size_t keylen) {
+	return sizeof(item) + (keylen > ITEM_INLINE_KEY_LEN ?
+			sizeof(struct sdshdr) + keylen + 1 : ITEM_INLINE_KEY_SIZE);
+}
+
+/* Items are allocated with the slab allocator if it is enabled, see
+ * slabs.h. Any value fitting the largest chunk is then embedded, so that
+ * all the memory of small and medium keys is in the slabs. Only items of
+ * keys too long for the largest chunk are allocated with zmalloc(). */
+static void *itemAlloc(size_t size) {
+	return slabsEnabled() && size <= SLAB_CHUNK_MAX ? slabsAlloc(size)
+			: zmalloc(size);
+}
+
+/* Return true if the item is in a slab chunk. Values are embedded only if
+ * the item still fits a chunk, so that depends on the key alone. */
+static int itemInSlabs(item *it) {
+	return slabsEnabled()
+			&& itemKeySize(sdslen(itemKey(it))) <= SLAB_CHUNK_MAX;
+}
+
+/* Free the memory of an item, used by the dict to free the entries. */
+static void itemFree(void *it) {
+	if (itemInSlabs(it))
+		slabsFree(it);
+	else
+		zfree(it);
+}
+
+/* Bytes usable in the allocation of the item. */
+static size_t itemAllocSize(item *it) {
+	return itemInSlabs(it) ? slabsUsableSize(it) : zmalloc_usable_size(it);
+}
+
+static int itemCanEmbed(size_t len) {
+	return len <= ITEM_EMBSTR_SIZE_LIMIT
+			|| (slabsEnabled() && len <= SLAB_CHUNK_MAX);
+}
+
+/* Address where an embedded value starts: right after the key and its
+ * padding, aligned for the sds header. */
+static char *itemEmbedPtr(item *it) {
+	sds key = itemKey(it);
+	uintptr_t p = (uintptr_t) (key + sdslen(key) + sdsavail(key) + 1);
+
+	return (char*) ((p + sizeof(int) - 1) & ~(uintptr_t) (sizeof(int) - 1));
+}
+
+/* Bytes available at the end of the item allocation for an embedded value.
+ * Items allocated with no room for a value may end before the aligned
+ * itemEmbedPtr(). */
+static size_t itemEmbedSpace(item *it) {
+	char *end = (char*) it + itemAllocSize(it), *p = itemEmbedPtr(it);
+
+	return p < end ? (size_t) (end - p) : 0;
+}
+
+static int valueIsInt(const char *v, size_t len, long *lv) {
+	return len <= 21 && string2l(v, len, lv);
+}
+
+static int valueIsTiny(const char *v, size_t len) {
+	return len <= VALUE_TINY_MAX_LEN && memchr(v, '\0', len) == NULL;
+}
+
+/* Compression stats, see getCompressionStats(). They are global rather
+ * than per DB, since values are decompressed by readers that don't know
+ * their DB, see valueToSds(), so they are updated with atomics. Times are
+ * in nanoseconds. */
+static struct {
+	long long values, skipped, bytes_in, bytes_out, time;
+	long long decompressions, decompress_time;
+} compress_stats;
+
+static int valueMayCompress(memoryDb *db, size_t len) {
+	return db->compress_min_len && len >= db->compress_min_len
+			&& len <= LZ4_MAX_INPUT_SIZE;
+}
+
+/* Return the value compressed, or NULL if it doesn't shrink enough. The
+ * compressed block is written with room for the smallest acceptable size
+ * only, so the compressor gives up early on data that doesn't compress. */
+static compressedValue *valueCompress(const char *v, size_t len) {
+	size_t max = len - len / VALUE_COMPRESS_MIN_SAVING;
+	compressedValue *cv = zmalloc(sizeof(*cv) + max);
+	long long start = nstime();
+	int clen = LZ4_compress_default(v, cv->data, len, max);
+
+	__atomic_fetch_add(&compress_stats.time, nstime() - start,
+			__ATOMIC_RELAXED);
+	if (clen == 0) {
+		zfree(cv);
+		__atomic_fetch_add(&compress_stats.skipped, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	cv = zrealloc(cv, sizeof(*cv) + clen);
+	cv->len = len;
+	cv->clen = clen;
+	__atomic_fetch_add(&compress_stats.values, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&compress_stats.bytes_in, len, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&compress_stats.bytes_out, clen, __ATOMIC_RELAXED);
+	return cv;
+}
+
+/* Decompress the cv->len bytes of the value to 'dst'. */
+static void valueDecompress(compressedValue *cv, char *dst) {
+	long long start = nstime();
+	int len = LZ4_decompress_safe(cv->data, dst, cv->clen, cv->len);
+
+	redisAssertWithInfo(NULL, NULL, len == (int) cv->len);
+	__atomic_fetch_add(&compress_stats.decompress_time, nstime() - start,
+			__ATOMIC_RELAXED);
+	__atomic_fetch_add(&compress_stats.decompressions, 1, __ATOMIC_RELAXED);
+}
+
+/* Add the compression stats to 'st', in microseconds. */
+void getCompressionStats(stats_t *st) {
+	st->compressed_values += __atomic_load_n(&compress_stats.values,
+			__ATOMIC_RELAXED);
+	st->compress_skipped += __atomic_load_n(&compress_stats.skipped,
+			__ATOMIC_RELAXED);
+	st->compress_bytes_in += __atomic_load_n(&compress_stats.bytes_in,
+			__ATOMIC_RELAXED);
+	st->compress_bytes_out += __atomic_load_n(&compress_stats.bytes_out,
+			__ATOMIC_RELAXED);
+	st->compress_time += __atomic_load_n(&compress_stats.time,
+			__ATOMIC_RELAXED) / 1000;
+	st->decompressions += __atomic_load_n(&compress_stats.decompressions,
+			__ATOMIC_RELAXED);
+	st->decompress_time += __atomic_load_n(&compress_stats.decompress_time,
+			__ATOMIC_RELAXED) / 1000;
+}
+
+/* Return the string of an ENCODING_TINY value. */
+static const char *valueTinyStr(value_t *val) {
+	return (const char*) &val->ptr;
+}
+
+/* Store the value in the item. Integers and tiny strings are encoded in
+ * the ptr field, values of at least db->compress_min_len bytes are
+ * compressed if they shrink enough, small strings are embedded if they fit
+ * the free space at the end of the item, otherwise they are stored out of
+ * line as raw sds strings. */
+static void itemStoreValue(memoryDb *db, item *it, const char *v, size_t len,
+		int isint, long lv) {
+	value_t *val = &it->val;
+	compressedValue *cv;
+
+	if (isint) {
+		val->encoding = ENCODING_INT;
+		val->ptr = (void*) lv;
+	} else if (valueIsTiny(v, len)) {
+		val->encoding = ENCODING_TINY;
+		val->ptr = NULL;
+		memcpy(&val->ptr, v, len);
+	} else if (valueMayCompress(db, len)
+			&& (cv = valueCompress(v, len)) != NULL) {
+		val->encoding = ENCODING_COMPRESSED;
+		val->ptr = cv;
+	} else if (itemCanEmbed(len)
+			&& sizeof(struct sdshdr) + len + 1 <= itemEmbedSpace(it)) {
+		val->encoding = ENCODING_EMBSTR;
+		val->ptr = embedSds(itemEmbedPtr(it), v, len);
 	} else {
-		val = createValue(ENCODING_INT, NULL);
-		val->ptr = (void*) ((long) v);
+		val->encoding = ENCODING_RAW;
+		val->ptr = sdsnewlen(v, len);
 	}
-	return val;
 }
 
-void freeValue(value_t *val) {
+/* Bytes needed by an item with a key of 'keylen' bytes and the value 'v',
+ * embedded if possible. 'noembed' is true if the value is not stored in
+ * the item anyway: integers, and values that may be compressed. */
+static size_t itemSize(size_t keylen, const char *v, size_t len,
+		int noembed) {
+	size_t size = itemKeySize(keylen);
+
+	if (!noembed && !valueIsTiny(v, len) && itemCanEmbed(len)) {
+		size_t embsize = size + sizeof(int) + sizeof(struct sdshdr) + len + 1;
+
+		/* With slabs values are embedded only if the item fits a chunk */
+		if (!slabsEnabled() || embsize <= SLAB_CHUNK_MAX)
+			size = embsize;
+	}
+	return size;
+}
+
+/* Create a new item with a copy of the key and of the value, using a
+ * single allocation unless the value is too big to be embedded. */
+item *createItem(memoryDb *db, const char *k, size_t klen, const char *v,
+		size_t len) {
+	long lv;
+	int isint = valueIsInt(v, len, &lv);
+	item *it = itemAlloc(itemSize(klen, v, len,
+			isint || valueMayCompress(db, len)));
+
+	embedKey(it->data, k, klen);
+	it->de.key = it->data + sizeof(struct sdshdr);
+	itemExpiresIndex(it) = 0;
+	it->de.next = NULL;
+	it->expire = -1;
+	it->val.cas = nextCasId();
+	it->val.lru = valueAccessInit();
+	itemStoreValue(db, it, v, len, isint, lv);
+	return it;
+}
+
+/* Replace the value of an item. The new value is embedded again if it fits
+ * the space of the item allocation. */
+void itemSetValue(memoryDb *db, item *it, const char *v, size_t len) {
+	long lv;
+	int isint = valueIsInt(v, len, &lv);
+
+	freeValuePayload(&it->val);
+	itemStoreValue(db, it, v, len, isint, lv);
+}
+
+/* Bytes used by an item, including the value stored out of line. */
+size_t itemMemoryUsage(item *it) {
+	size_t size = itemAllocSize(it);
+
+	if (it->val.encoding == ENCODING_RAW)
+		size += zmalloc_size((char*) it->val.ptr - sizeof(struct sdshdr));
+	else if (it->val.encoding == ENCODING_ROPE)
+		size += ropeAllocSize(it->val.ptr);
+	else if (it->val.encoding == ENCODING_COMPRESSED)
+		size += zmalloc_size(it->val.ptr);
+	return size;
+}
+
+/* Add a volatile item to db->expires. */
+static void expiresAdd(memoryDb *db, item *it) {
+	if (db->expires_count == db->expires_size) {
+		db->expires_size = db->expires_size ? db->expires_size * 2 : 16;
+		db->expires = zrealloc(db->expires, sizeof(item*) * db->expires_size);
+	}
+	itemExpiresIndex(it) = db->expires_count;
+	db->expires[db->expires_count++] = it;
+}
+
+/* Remove an item from db->expires, moving the last item in its place. */
+static void expiresRemove(memoryDb *db, item *it) {
+	item *last = db->expires[--db->expires_count];
+
+	db->expires[itemExpiresIndex(it)] = last;
+	itemExpiresIndex(last) = itemExpiresIndex(it);
+	if (db->expires_size > 16 && db->expires_count < db->expires_size / 4) {
+		db->expires_size /= 2;
+		db->expires = zrealloc(db->expires, sizeof(item*) * db->expires_size);
+	}
+}
+
+/* Called when an item leaves the keyspace. When the item was replaced by a
+ * copy (see dbOverwrite()) the copy already took its place in db->expires. */
+static void expiresUnlink(memoryDb *db, item *it) {
+	if (it->expire != -1 && db->expires[itemExpiresIndex(it)] == it)
+		expiresRemove(db, it);
+}
+
+/* Free the out of line part of a value, if any. */
+void freeValuePayload(value_t *val) {
 	if (val->encoding == ENCODING_RAW) {
 		sdsfree(val->ptr);
+	} else if (val->encoding == ENCODING_ROPE) {
+		ropeFree(val->ptr);
+	} else if (val->encoding == ENCODING_COMPRESSED) {
+		zfree(val->ptr);
 	}
-	zfree(val);
+	val->encoding = ENCODING_INT;
+	val->ptr = NULL;
+}
+
+/* Return the integer of an ENCODING_INT value. Integers are the only values
+ * modified in place while readers not holding the lock may access them (see
+ * dbIncrBy()), so they are always loaded atomically. */
+static long valueIntGet(value_t *val) {
+	return (long) __atomic_load_n(&val->ptr, __ATOMIC_RELAXED);
 }
 
 int getLongLongFromValue(value_t *val, long long *ret) {
@@ -47,12 +402,20 @@ int getLongLongFromValue(value_t *val, long long *ret) {
 		v = 0;
 	} else {
 		if (val->encoding == ENCODING_INT) {
-			v = (long) val->ptr;
-		} else if (val->encoding == ENCODING_RAW) {
+			v = valueIntGet(val);
+		} else if (val->encoding == ENCODING_ROPE
+				|| val->encoding == ENCODING_COMPRESSED) {
+			/* Ropes and compressed values are longer than any integer */
+			return MDB_ERR;
+		} else if (val->encoding == ENCODING_RAW
+				|| val->encoding == ENCODING_EMBSTR
+				|| val->encoding == ENCODING_TINY) {
+			const char *s = val->encoding == ENCODING_TINY ?
+					valueTinyStr(val) : val->ptr;
+
 			errno = 0;
-			v = strtoll(val->ptr, &eptr, 10);
-			if (isspace(((char*) val->ptr)[0]) || eptr[0] != '\0'
-			|| errno == ERANGE)
+			v = strtoll(s, &eptr, 10);
+			if (isspace(s[0]) || eptr[0] != '\0' || errno == ERANGE)
 				return MDB_ERR;
 		} else {
 			panic("Unknown encoding");
@@ -62,20 +425,70 @@ int getLongLongFromValue(value_t *val, long long *ret) {
 	return MDB_OK;
 }
 
+/* Return a new sds string with the content of the value. */
+sds valueToSds(value_t *val) {
+	if (val->encoding == ENCODING_INT)
+		return sdsfromlonglong(valueIntGet(val));
+	if (val->encoding == ENCODING_TINY)
+		return sdsnew(valueTinyStr(val));
+	if (val->encoding == ENCODING_ROPE) {
+		rope *r = val->ptr;
+		sds s = sdsnewlen(NULL, r->len);
+
+		ropeCopy(r, s);
+		return s;
+	}
+	if (val->encoding == ENCODING_COMPRESSED) {
+		compressedValue *cv = val->ptr;
+		sds s = sdsnewlen(NULL, cv->len);
+
+		valueDecompress(cv, s);
+		return s;
+	}
+	return sdsdup(val->ptr);
+}
+
+static void dbReclaim(void *ptr, void (*freefn)(void *ptr));
+
+static void ropeFreeRetired(void *r) {
+	ropeFree(r);
+}
+
+/* Convert a rope value to a raw sds string, for the reads that need the
+ * value to be contiguous. The DB lock must be held. Pinned readers may be
+ * accessing the segments of the rope (see valueIovec()), so it is freed
+ * through dbReclaim(). */
+static void valueFlatten(value_t *val) {
+	rope *r = val->ptr;
+
+	val->ptr = valueToSds(val);
+	val->encoding = ENCODING_RAW;
+	dbReclaim(r, ropeFreeRetired);
+}
+
+/* Convert the value to a raw sds string that can be modified in place,
+ * like appending to it. Embedded strings are copied out of the item, and
+ * compressed values are decompressed. */
 value_t *toStringValue(value_t *val) {
+	sds p;
+
+	if (val->encoding == ENCODING_ROPE)
+		valueFlatten(val);
 	if (val->encoding == ENCODING_RAW)
 		return val;
-	long long v = (long) val->ptr;
-	sds *p = sdsfromlonglong(v);
+	p = valueToSds(val);
 	if (p == NULL)
 		return NULL;
+	if (val->encoding == ENCODING_COMPRESSED)
+		dbReclaim(val->ptr, zfree);
+	val->encoding = ENCODING_RAW;
 	val->ptr = p;
 	return val;
 }
 
 // try encode a string value as integer.
 value_t *tryValueEncoding(value_t *val) {
-	if (val->encoding == ENCODING_INT)
+	if (val->encoding != ENCODING_RAW)
 		return val;
 	size_t len = sdslen(val->ptr);
 	long v;
@@ -89,30 +502,144 @@ value_t *tryValueEncoding(value_t *val) {
 		sdsfree(val->ptr);
 		val->ptr = (void*) ((long) v);
 	}
+	return val;
 }
 
-void incValueVersion(value_t *val) {
-	val->ver++;
+/* CAS ids are unique across all the slots. Every thread reserves blocks of
+ * CAS_ID_BLOCK ids from a global counter, so that most writes take an id
+ * with no contended atomic. Ids are not ordered across threads, and 0 is
+ * never used. */
+#define CAS_ID_BLOCK 1024
+
+static uint64_t cas_counter = 1;
+static __thread uint64_t cas_next = 0, cas_end = 0;
+
+/* Return the CAS id of a new write. */
+uint64_t nextCasId(void) {
+	if (cas_next == cas_end) {
+		cas_next = __atomic_fetch_add(&cas_counter, CAS_ID_BLOCK,
+				__ATOMIC_RELAXED);
+		cas_end = cas_next + CAS_ID_BLOCK;
+	}
+	return cas_next++;
 }
 
-void setValueVersion(value_t *val, unsigned ver) {
-	//TODO: check overflow
-	val->ver = ver;
+/* Return the CAS id of the value. It is loaded before the value is read:
+ * dbIncrBy() stores the CAS id after the integer, so readers not holding
+ * the lock never pair a new CAS id with an old value. */
+uint64_t valueCas(value_t *val) {
+	return __atomic_load_n(&val->cas, __ATOMIC_ACQUIRE);
 }
 
-void resetValueVersion(value_t *val) {
-	val->ver = 0;
+/* Return the string of the value, setting '*len' to its length. Integers
+ * and tiny strings are written to 'buf', of VALUE_STR_BUF_SIZE bytes, and
+ * compressed values are decompressed to a new sds string, returned in
+ * '*copy' for the caller to free; '*copy' is NULL otherwise. The other
+ * strings are returned in place, with no copy. Ropes are flattened first,
+ * so unless the DB has concurrent readers, that never see ropes, the lock
+ * must be held. */
+const char *valueString(value_t *val, char *buf, size_t *len, sds *copy) {
+	*copy = NULL;
+	if (val->encoding == ENCODING_ROPE)
+		valueFlatten(val);
+	if (val->encoding == ENCODING_COMPRESSED) {
+		*copy = valueToSds(val);
+		*len = sdslen(*copy);
+		return *copy;
+	}
+	if (val->encoding == ENCODING_INT) {
+		*len = ll2string(buf, VALUE_STR_BUF_SIZE, valueIntGet(val));
+		return buf;
+	}
+	if (val->encoding == ENCODING_TINY) {
+		*len = strlen(valueTinyStr(val));
+		memcpy(buf, valueTinyStr(val), *len + 1);
+		return buf;
+	}
+	*len = sdslen(val->ptr);
+	return val->ptr;
 }
 
 size_t valueLen(value_t *val) {
-	if (val->encoding == ENCODING_RAW)
-		return 0;
+	char buf[32];
+
+	if (val->encoding == ENCODING_INT)
+		return ll2string(buf, sizeof(buf), valueIntGet(val));
+	if (val->encoding == ENCODING_TINY)
+		return strlen(valueTinyStr(val));
+	if (val->encoding == ENCODING_ROPE)
+		return ((rope*) val->ptr)->len;
+	if (val->encoding == ENCODING_COMPRESSED)
+		return ((compressedValue*) val->ptr)->len;
 	return sdslen(val->ptr);
 }
+
+/* Set 'iov' to the bytes of the value, for writev(), returning the number
+ * of iovecs set. Ropes are returned with no copy, an iovec per segment,
+ * unless they have more than 'max' segments: then they are flattened, see
+ * valueString(). Other values take a single iovec, and integers and tiny
+ * strings are written to 'buf', of VALUE_STR_BUF_SIZE bytes. Compressed
+ * values are decompressed to '*copy', as in valueString(). */
+int valueIovec(value_t *val, struct iovec *iov, int max, char *buf,
+		sds *copy) {
+	int n;
+
+	if (val->encoding == ENCODING_ROPE) {
+		*copy = NULL;
+		n = ropeIovec(val->ptr, iov, max);
+		if (n >= 0)
+			return n;
+	}
+	iov->iov_base = (void*) valueString(val, buf, &iov->iov_len, copy);
+	return 1;
+}
+
+/* Append 'len' bytes to the value in place, or prepend them if 'prepend'
+ * is true, returning the new length. The items of the DB must not be
+ * shared, see dbItemsShared(). Values are converted to raw sds strings,
+ * or with DB_ROPES to ropes once they reach VALUE_ROPE_MIN_LEN bytes, so
+ * that a large value is not copied at every append or prepend. */
+size_t valueAppend(memoryDb *db, value_t *val, const char *s, size_t len,
+		int prepend) {
+	char buf[VALUE_STR_BUF_SIZE];
+	const char *p;
+	size_t plen;
+	rope *r;
+	sds tmp, copy;
+
+	if (val->encoding != ENCODING_ROPE && db->flags & DB_ROPES
+			&& valueLen(val) + len >= VALUE_ROPE_MIN_LEN) {
+		p = valueString(val, buf, &plen, &copy);
+		r = ropeNew(p, plen);
+		sdsfree(copy);
+		freeValuePayload(val);
+		val->encoding = ENCODING_ROPE;
+		val->ptr = r;
+	}
+	if (val->encoding == ENCODING_ROPE) {
+		if (prepend)
+			ropePrepend(val->ptr, s, len);
+		else
+			ropeAppend(val->ptr, s, len);
+	} else {
+		/* Integer and embedded values are converted to a raw sds first */
+		toStringValue(val);
+		if (prepend) {
+			tmp = val->ptr;
+			val->ptr = sdscatsds(sdsnewlen(s, len), tmp);
+			sdsfree(tmp);
+		} else {
+			val->ptr = sdscatlen(val->ptr, s, len);
+		}
+	}
+	val->cas = nextCasId();
+	return valueLen(val);
+}
+
 /*-----------------------------------------------------------------------------
  * C-level DB API
  *----------------------------------------------------------------------------*/
-unsigned int dictSdsHash(const void *key) {
+uint64_t dictSdsHash(const void *key) {
 	return dictGenHashFunction((unsigned char*) key, sdslen((char*) key));
 }
 
@@ -127,59 +654,163 @@ int dictSdsKeyCompare(void *privdata, const void *key1, const void *key2) {
 	return memcmp(key1, key2, l1) == 0;
 }
 
+/* Compare two padded keys, sds headers included. */
+static inline int keyBlockEqual(const char *b1, const char *b2) {
+#if defined(__SSE2__)
+	__m128i lo = _mm_xor_si128(_mm_loadu_si128((const __m128i*) b1),
+			_mm_loadu_si128((const __m128i*) b2));
+	__m128i hi = _mm_xor_si128(_mm_loadu_si128((const __m128i*) (b1 + 16)),
+			_mm_loadu_si128((const __m128i*) (b2 + 16)));
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_or_si128(lo, hi),
+			_mm_setzero_si128())) == 0xffff;
+#else
+	return memcmp(b1, b2, ITEM_INLINE_KEY_SIZE) == 0;
+#endif
+}
+
+/* Compare the keys of a db. Padded keys are compared as a block that
+ * includes the sds headers, so it only matches if the lengths match. */
+int dictItemKeyCompare(void *privdata, const void *key1, const void *key2) {
+	if (!keyIsInline((sds) key1) || !keyIsInline((sds) key2))
+		return dictSdsKeyCompare(privdata, key1, key2);
+	return keyBlockEqual((const char*) key1 - sizeof(struct sdshdr),
+			(const char*) key2 - sizeof(struct sdshdr));
+}
+
 void dictSdsDestructor(void *privdata, void *val) {
 	DICT_NOTUSED(privdata);
 
 	sdsfree(val);
 }
 
-void dictValueDestructor(void *privdata, void *val) {
-	DICT_NOTUSED(privdata);
-	freeValue(val);
+static void sdsFreeRetired(void *s) {
+	sdsfree(s);
+}
+
+/* Like dictItemDestructor(), for DBs with concurrent readers: the value is
+ * left untouched and the payload is freed when no reader can access it. */
+void dictItemRetire(void *privdata, void *key) {
+	item *it = keyItem(key);
+
+	expiresUnlink(privdata, it);
+	if (it->val.encoding == ENCODING_RAW)
+		epochRetire(it->val.ptr, sdsFreeRetired);
+	else if (it->val.encoding == ENCODING_ROPE)
+		epochRetire(it->val.ptr, ropeFreeRetired);
+	else if (it->val.encoding == ENCODING_COMPRESSED)
+		epochRetire(it->val.ptr, zfree);
+}
+
+/* The item is freed by the dict together with the entry, see createItem():
+ * we only need to release the value stored out of line, and to remove the
+ * item from the expires of the DB, that is the dict privdata. Pinned values
+ * may be read without the lock, see dbItemsShared(): then the value is
+ * retired as with concurrent readers. */
+void dictItemDestructor(void *privdata, void *key) {
+	item *it = keyItem(key);
+
+	if (epochPinned()) {
+		dictItemRetire(privdata, key);
+		return;
+	}
+	expiresUnlink(privdata, it);
+	freeValuePayload(&it->val);
+}
+
+/* Memory freed by the dict of DBs without concurrent readers: entries and
+ * tables are freed at once, unless values are pinned. Once the pins are
+ * released the objects retired meanwhile are freed by the following calls,
+ * that keep retiring until the queue of the thread is empty. */
+static void dbReclaim(void *ptr, void (*freefn)(void *ptr)) {
+	if (epochPinned() || epochPending())
+		epochRetire(ptr, freefn);
+	else
+		freefn(ptr);
 }
 
+/* Db->dict, keys are embedded in the items */
 dictType dbDictType = {
 		dictSdsHash, /* hash function */
 		NULL, /* key dup */
 		NULL, /* val dup */
-		dictSdsKeyCompare, /* key compare */
-		dictSdsDestructor, /* key destructor */
-		dictValueDestructor /* val destructor */
-};
-/* Db->expires */
-dictType keyptrDictType = {
-		dictSdsHash, /* hash function */
-		NULL, /* key dup */
-		NULL, /* val dup */
-		dictSdsKeyCompare, /* key compare */
-		NULL, /* key destructor */
-		NULL /* val destructor */
+		dictItemKeyCompare, /* key compare */
+		dictItemDestructor, /* key destructor */
+		NULL, /* val destructor */
+		itemFree /* entry free */
 };
-
-dictType hashSlotType = {
+/* Db->dict of DB_CONCURRENT DBs */
+dictType dbConcurrentDictType = {
 		dictSdsHash, /* hash function */
 		NULL, /* key dup */
 		NULL, /* val dup */
-		dictSdsKeyCompare, /* key compare */
-		NULL, /* key destructor */
-		NULL /* val destructor */
+		dictItemKeyCompare, /* key compare */
+		dictItemRetire, /* key destructor */
+		NULL, /* val destructor */
+		itemFree /* entry free */
 };
 
-memoryDb *memoryDbNew(int numSlots) {
+/* Create a new DB. 'engine' selects the hash table implementation used for
+ * the keyspace, see DICT_ENGINE_* in dict.h.
+ *
+ * With the DB_CONCURRENT flag keys can be looked up without the lock, with
+ * lookupKeyReadConcurrent(). Items are then never modified once added to
+ * the keyspace, they are replaced by a new copy, and the memory that
+ * readers may be accessing is freed through epochs. The exception are
+ * integers, incremented in place with atomic stores, see dbIncrBy().
+ *
+ * Any DB can also have its values pinned (see getPinned() in mdb.c): they
+ * are read without the lock as long as the pin is held, so while there are
+ * pins the writes behave as with DB_CONCURRENT, see dbItemsShared(). */
+memoryDb *memoryDbNew(int id, int engine, int flags) {
 	memoryDb *db = zmalloc(sizeof(*db));
-	db->dict = dictCreate(dbDictType, NULL);
-	db->expires = dictCreate(keyptrDictType, NULL);
-	db->slots = zmalloc(numSlots * sizeof(dict*));
-	int i;
-	for (i = 0; i < numSlots; ++i) {
-		db->slots[i] = dictCreate(hashSlotType, NULL);
+
+	if (flags & DB_CONCURRENT) {
+		db->dict = dictCreateWithEngine(&dbConcurrentDictType, db, engine);
+		dictEnableConcurrentReaders(db->dict, epochRetire);
+	} else {
+		db->dict = dictCreateWithEngine(&dbDictType, db, engine);
+		dictEnableConcurrentReaders(db->dict, dbReclaim);
 	}
+	db->expires = NULL;
+	db->expires_count = db->expires_size = 0;
+	evictionPoolInit(db);
+	db->sketch = NULL;
+	pthread_mutex_init(&db->lock, NULL);
+	memset(&db->stats, 0, sizeof(db->stats));
+	db->id = id;
+	db->flags = flags;
+	db->compress_min_len = 0;
+	db->arena = flags & DB_ARENAS ? zmalloc_arena_create() : ZMALLOC_NO_ARENA;
+	return db;
+}
+
+/* Return the entry of the key 'k' of 'klen' bytes, with 'h' its hash. */
+static dictEntry *dbFind(memoryDb *db, const char *k, size_t klen,
+		uint64_t h) {
+	keyBuf kb;
+	dictEntry *de = dictFindWithHash(db->dict, keyBufInit(&kb, k, klen), h);
+
+	keyBufRelease(&kb);
+	return de;
+}
+
+/* Hash of a key of the keyspace, the same dictSdsHash() computes. */
+static uint64_t keyHash(const char *k, size_t klen) {
+	return dictGenHashFunction(k, klen);
 }
 
-value_t *lookupKey(memoryDb *db, sds *key) {
-	dictEntry *de = dictFind(db->dict, key);
+/* Return true if the items of the DB may be read without its lock: by
+ * concurrent readers, or through pinned values. Items must not be modified
+ * then, but replaced, and the memory of the old ones is retired. */
+int dbItemsShared(memoryDb *db) {
+	return db->flags & DB_CONCURRENT || epochPinned();
+}
+
+value_t *lookupKey(memoryDb *db, const char *k, size_t klen) {
+	dictEntry *de = dbFind(db, k, klen, keyHash(k, klen));
 	if (de) {
-		value_t *val = dictGetVal(de);
+		value_t *val = &entryItem(de)->val;
 
 		return val;
 	} else {
@@ -187,86 +818,357 @@ value_t *lookupKey(memoryDb *db, sds *key) {
 	}
 }
 
-value_t *lookupKeyRead(memoryDb *db, sds *key) {
-	value_t *val;
+value_t *lookupKeyRead(memoryDb *db, const char *k, size_t klen) {
+	return lookupKeyReadWithHash(db, k, klen, keyHash(k, klen));
+}
+
+/* Like lookupKeyRead(), with 'h' the hash of the key, for the callers that
+ * already computed it. */
+value_t *lookupKeyReadWithHash(memoryDb *db, const char *k, size_t klen,
+		uint64_t h) {
+	dictEntry *de = dbFind(db, k, klen, h);
+	value_t *val = NULL;
 
-	expireIfNeeded(db, key);
-	val = lookupKey(db, key);
+	if (de && !itemExpireIfNeeded(db, entryItem(de))) {
+		valueTouch(&entryItem(de)->val);
+		val = &entryItem(de)->val;
+	}
 	if (val == NULL)
-		stats.keyspace_misses++;
+		db->stats.keyspace_misses++;
 	else
-		stats.keyspace_hits++;
+		db->stats.keyspace_hits++;
 	return val;
 }
 
-value_t *lookupKeyWrite(memoryDb *db, sds *key) {
-	expireIfNeeded(db, key);
-	return lookupKey(db, key);
+/* Lookup a key for reading without holding the lock of the DB, that must
+ * be a DB_CONCURRENT one. The caller must be inside an epoch read section
+ * (see epoch.h) as long as it uses the returned value.
+ *
+ * Expired keys are not returned, and they are deleted taking the lock. */
+value_t *lookupKeyReadConcurrent(memoryDb *db, const char *k, size_t klen) {
+	return lookupKeyReadConcurrentWithHash(db, k, klen, keyHash(k, klen));
+}
+
+/* Like lookupKeyReadConcurrent(), with 'h' the hash of the key. */
+value_t *lookupKeyReadConcurrentWithHash(memoryDb *db, const char *k,
+		size_t klen, uint64_t h) {
+	keyBuf kb;
+	dictEntry *de = dictFindConcurrentWithHash(db->dict,
+			keyBufInit(&kb, k, klen), h);
+	value_t *val = NULL;
+
+	keyBufRelease(&kb);
+	if (de) {
+		item *it = entryItem(de);
+		mstime_t when = __atomic_load_n(&it->expire, __ATOMIC_RELAXED);
+
+		if (when >= 0 && cachedMstime() > when) {
+			pthread_mutex_lock(&db->lock);
+			expireIfNeeded(db, k, klen);
+			pthread_mutex_unlock(&db->lock);
+		} else {
+			/* Only the access data is modified in published items */
+			valueTouch(&it->val);
+			val = &it->val;
+		}
+	}
+	if (val == NULL)
+		__atomic_fetch_add(&db->stats.keyspace_misses, 1, __ATOMIC_RELAXED);
+	else
+		__atomic_fetch_add(&db->stats.keyspace_hits, 1, __ATOMIC_RELAXED);
+	return val;
 }
 
-/* Add the key to the DB. It's up to the caller to increment the reference
- * counter of the value if needed.
+/* Lookup a key, deleting it if it is expired. The expire time is stored
+ * in the item, so checking it requires no further lookup. */
+value_t *lookupKeyWrite(memoryDb *db, const char *k, size_t klen) {
+	dictEntry *de = dbFind(db, k, klen, keyHash(k, klen));
+
+	if (de == NULL || itemExpireIfNeeded(db, entryItem(de)))
+		return NULL;
+	valueTouch(&entryItem(de)->val);
+	return &entryItem(de)->val;
+}
+
+/* Add the key to the DB. Both the key and the value are copied in a new
+ * item.
  *
  * The program is aborted if the key already exists. */
-void dbAdd(memoryDb *db, sds *key, value_t *val) {
-	sds copy = sdsdup(key);
-	resetValueVersion(val);
-	int retval = dictAdd(db->dict, copy, val);
+void dbAdd(memoryDb *db, const char *k, size_t klen, const char *v,
+		size_t len) {
+	item *it = createItem(db, k, klen, v, len);
+	int retval = dictAddEntry(db->dict, &it->de);
+
+	redisAssertWithInfo(NULL, NULL, retval == DICT_OK);
+}
+
+/* Return true if with slabs the item is in a chunk of the wrong size to
+ * store the value 'v'. */
+static int itemNeedsResize(memoryDb *db, item *it, const char *v,
+		size_t len) {
+	long lv;
+	size_t size = itemSize(sdslen(itemKey(it)), v, len,
+			valueIsInt(v, len, &lv) || valueMayCompress(db, len));
 
-	redisAssertWithInfo(NULL, key, retval == MDB_OK);
+	return slabsChunkSize(size) != itemAllocSize(it);
+}
+
+/* Implements dbOverwrite() for the item 'it'. Returns the item now holding
+ * the key, that is 'it' unless it was replaced. */
+static item *overwriteItem(memoryDb *db, item *it, const char *v,
+		size_t len) {
+	if (dbItemsShared(db) || (itemInSlabs(it) && itemNeedsResize(db, it,
+			v, len))) {
+		sds key = itemKey(it);
+		item *newit = createItem(db, key, sdslen(key), v, len);
+
+		newit->expire = it->expire;
+		newit->val.lru = __atomic_load_n(&it->val.lru, __ATOMIC_RELAXED);
+		if (it->expire != -1) {
+			itemExpiresIndex(newit) = itemExpiresIndex(it);
+			db->expires[itemExpiresIndex(it)] = newit;
+		}
+		dictReplaceEntry(db->dict, &it->de, &newit->de);
+		return newit;
+	}
+	itemSetValue(db, it, v, len);
+	it->val.cas = nextCasId();
+	return it;
 }
 
-/* Overwrite an existing key with a new value. Incrementing the reference
- * count of the new value is up to the caller.
+/* Overwrite an existing key with a new value. The value is updated in the
+ * existing item, that is not reallocated, unless the items are shared with
+ * readers not holding the lock (see dbItemsShared()): in that case the item
+ * is replaced by a new one. With slabs the item is replaced as well if the
+ * new value needs another chunk size, so that it moves to the class of its
+ * new size instead of keeping the value outside of the chunk.
  * This function does not modify the expire time of the existing key.
  *
  * The program is aborted if the key was not already present. */
-void dbOverwrite(memoryDb *db, sds *key, value_t *val) {
-	struct dictEntry *de = dictFind(db->dict, key);
+void dbOverwrite(memoryDb *db, const char *k, size_t klen, const char *v,
+		size_t len) {
+	struct dictEntry *de = dbFind(db, k, klen, keyHash(k, klen));
 
-	redisAssertWithInfo(NULL, key, de != NULL);
-	value_t *oldval = dictGetVal(de);
-	setValueVersion(val, oldval->ver+1);
-	dictReplace(db->dict, key, val);
+	redisAssertWithInfo(NULL, NULL, de != NULL);
+	overwriteItem(db, entryItem(de), v, len);
 }
 
 /* High level Set operation. This function can be used in order to set
  * a key, whatever it was existing or not, to a new object.
  *
  * 1) The expire time of the key is reset (the key is made persistent). */
-void setKey(memoryDb *db, sds *key, value_t *val) {
-	if (lookupKeyWrite(db, key) == NULL) {
-		dbAdd(db, key, val);
+void setKey(memoryDb *db, const char *k, size_t klen, const char *v,
+		size_t len) {
+	setKeyWithHash(db, k, klen, keyHash(k, klen), v, len, 0);
+}
+
+/* Write the value 'v' to the existing item 'it', with the expire 'when',
+ * or making the key persistent if 'when' is zero. */
+static void setItem(memoryDb *db, item *it, const char *v, size_t len,
+		long long when) {
+	valueTouch(&it->val);
+	it = overwriteItem(db, it, v, len);
+	if (it->expire != -1 && when == 0) {
+		expiresRemove(db, it);
+		__atomic_store_n(&it->expire, -1, __ATOMIC_RELAXED);
+	}
+	if (when) {
+		if (it->expire == -1)
+			expiresAdd(db, it);
+		__atomic_store_n(&it->expire, when, __ATOMIC_RELAXED);
+	}
+}
+
+/* Like setKey() followed, if 'when' is not zero, by setExpire(), with a
+ * single lookup of the key. 'h' is the hash of the key. */
+void setKeyWithHash(memoryDb *db, const char *k, size_t klen, uint64_t h,
+		const char *v, size_t len, long long when) {
+	dictEntry *de = dbFind(db, k, klen, h);
+	item *it;
+
+	if (de && !itemExpireIfNeeded(db, entryItem(de))) {
+		setItem(db, entryItem(de), v, len, when);
 	} else {
-		dbOverwrite(db, key, val);
+		it = createItem(db, k, klen, v, len);
+		redisAssertWithInfo(NULL, NULL,
+				dictAddNewEntry(db->dict, &it->de, h) == DICT_OK);
+		if (when) {
+			expiresAdd(db, it);
+			__atomic_store_n(&it->expire, when, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/* Set the key to 'v' like setKeyWithHash(), only if its CAS id is 'cas'.
+ * Returns DB_CAS_STORED, DB_CAS_EXISTS if the key was written since the
+ * CAS id was read, or DB_CAS_NOT_FOUND. */
+int dbCompareAndSet(memoryDb *db, const char *k, size_t klen, uint64_t h,
+		const char *v, size_t len, long long when, uint64_t cas) {
+	dictEntry *de = dbFind(db, k, klen, h);
+
+	/* Failures are also counted without the lock, see below */
+	if (de == NULL || itemExpireIfNeeded(db, entryItem(de))) {
+		__atomic_fetch_add(&db->stats.cas_misses, 1, __ATOMIC_RELAXED);
+		return DB_CAS_NOT_FOUND;
+	}
+	if (entryItem(de)->val.cas != cas) {
+		__atomic_fetch_add(&db->stats.cas_badval, 1, __ATOMIC_RELAXED);
+		return DB_CAS_EXISTS;
 	}
-	removeExpire(db, key);
+	setItem(db, entryItem(de), v, len, when);
+	db->stats.cas_hits++;
+	return DB_CAS_STORED;
 }
 
-int dbExists(memoryDb *db, sds *key) {
-	return dictFind(db->dict, key) != NULL;
+/* Like dbCompareAndSet(), without writing and without the lock of the DB,
+ * that must be a DB_CONCURRENT one: the caller must be inside an epoch read
+ * section. Returns DB_CAS_STORED if the CAS id matches, so that the write
+ * may succeed, otherwise what dbCompareAndSet() would return. The stats are
+ * only updated on failure: a match is counted by the write. */
+int dbCompareCasConcurrent(memoryDb *db, const char *k, size_t klen,
+		uint64_t h, uint64_t cas) {
+	keyBuf kb;
+	dictEntry *de = dictFindConcurrentWithHash(db->dict,
+			keyBufInit(&kb, k, klen), h);
+	item *it;
+	mstime_t when;
+
+	keyBufRelease(&kb);
+	if (de == NULL) {
+		__atomic_fetch_add(&db->stats.cas_misses, 1, __ATOMIC_RELAXED);
+		return DB_CAS_NOT_FOUND;
+	}
+	it = entryItem(de);
+	when = __atomic_load_n(&it->expire, __ATOMIC_RELAXED);
+	/* Expired keys are deleted by the write under the lock */
+	if (when >= 0 && cachedMstime() > when)
+		return DB_CAS_STORED;
+	if (valueCas(&it->val) != cas) {
+		__atomic_fetch_add(&db->stats.cas_badval, 1, __ATOMIC_RELAXED);
+		return DB_CAS_EXISTS;
+	}
+	return DB_CAS_STORED;
 }
 
-/* Delete a key, value, and associated expiration entry if any, from the DB */
-int dbDelete(memoryDb *db, sds *key) {
-	/* Deleting an entry from the expires dict will not free the sds of
-	 * the key, because it is shared with the main dictionary. */
-	if (dictSize(db->expires) > 0)
-		dictDelete(db->expires, key);
-	if (dictDelete(db->dict, key) == DICT_OK) {
-		return 1;
+/* Increment the integer value of a key by 'incr' with a single lookup,
+ * creating the key with the value 'incr' if it doesn't exist. 'h' is the
+ * hash of the key. The new value is stored in '*result'. Returns MDB_ERR,
+ * doing nothing, if the value is not an integer or the result would
+ * overflow.
+ *
+ * Integer encoded values are updated in place, with no allocation, even if
+ * the items are shared with readers not holding the lock: the integer is a
+ * single word stored atomically, followed by its new CAS id. Writers still
+ * hold the lock, since the other writes of the slot replace items. */
+int dbIncrBy(memoryDb *db, const char *k, size_t klen, uint64_t h,
+		long long incr, long long *result) {
+	dictEntry *de = dbFind(db, k, klen, h);
+	value_t *val = NULL;
+	item *it;
+	long long v;
+	char buf[32];
+	int len;
+
+	if (de && !itemExpireIfNeeded(db, entryItem(de)))
+		val = &entryItem(de)->val;
+	if (getLongLongFromValue(val, &v) != MDB_OK)
+		return MDB_ERR;
+	if ((incr < 0 && v < 0 && incr < (LLONG_MIN - v))
+			|| (incr > 0 && v > 0 && incr > (LLONG_MAX - v)))
+		return MDB_ERR;
+	v += incr;
+	*result = v;
+
+	if (val == NULL) {
+		len = ll2string(buf, sizeof(buf), v);
+		it = createItem(db, k, klen, buf, len);
+		redisAssertWithInfo(NULL, NULL,
+				dictAddNewEntry(db->dict, &it->de, h) == DICT_OK);
+		return MDB_OK;
+	}
+	valueTouch(val);
+	if (val->encoding == ENCODING_INT && v >= LONG_MIN && v <= LONG_MAX) {
+		__atomic_store_n(&val->ptr, (void*) (long) v, __ATOMIC_RELAXED);
+		__atomic_store_n(&val->cas, nextCasId(), __ATOMIC_RELEASE);
 	} else {
+		len = ll2string(buf, sizeof(buf), v);
+		overwriteItem(db, entryItem(de), buf, len);
+	}
+	return MDB_OK;
+}
+
+int dbExists(memoryDb *db, const char *k, size_t klen) {
+	return dbFind(db, k, klen, keyHash(k, klen)) != NULL;
+}
+
+/* Delete a key, value, and associated expiration entry if any, from the DB.
+ * The item is removed from db->expires by the dict value destructor. */
+int dbDelete(memoryDb *db, const char *k, size_t klen) {
+	keyBuf kb;
+	int retval = dictDelete(db->dict, keyBufInit(&kb, k, klen));
+
+	keyBufRelease(&kb);
+	return retval == DICT_OK;
+}
+
+/* Delete an item of the DB, using its own key for the lookup. */
+static int dbDeleteItem(memoryDb *db, item *it) {
+	return dictDelete(db->dict, itemKey(it)) == DICT_OK;
+}
+
+/* Move an item to a new allocation, so that the slab page holding it can
+ * be released, see slabs.h. Returns 0 if 'it' is not an item of the DB. */
+int dbMoveItem(memoryDb *db, item *it) {
+	dictEntry *de = dictFind(db->dict, itemKey(it));
+	size_t size = itemAllocSize(it);
+	item *newit;
+	ptrdiff_t delta;
+
+	if (de == NULL || entryItem(de) != it)
 		return 0;
+	newit = itemAlloc(size);
+	memcpy(newit->data, it->data, size - offsetof(item, data));
+	newit->de = it->de;
+	newit->expire = it->expire;
+	newit->val.encoding = it->val.encoding;
+	newit->val.cas = it->val.cas;
+	newit->val.lru = __atomic_load_n(&it->val.lru, __ATOMIC_RELAXED);
+	newit->val.ptr = it->val.ptr;
+	delta = (char*) newit - (char*) it;
+	newit->de.key = (char*) it->de.key + delta;
+	if (it->val.encoding == ENCODING_EMBSTR) {
+		newit->val.ptr = (char*) it->val.ptr + delta;
+	} else if (it->val.encoding == ENCODING_RAW
+			|| it->val.encoding == ENCODING_ROPE
+			|| it->val.encoding == ENCODING_COMPRESSED) {
+		/* Readers may be accessing the value of the old item, that will be
+		 * freed with it. Otherwise just hand the value to the copy. */
+		if (dbItemsShared(db) && it->val.encoding == ENCODING_COMPRESSED) {
+			compressedValue *cv = it->val.ptr;
+			size_t cvsize = sizeof(*cv) + cv->clen;
+
+			newit->val.ptr = memcpy(zmalloc(cvsize), cv, cvsize);
+		} else if (dbItemsShared(db)) {
+			newit->val.ptr = valueToSds(&it->val);
+			newit->val.encoding = ENCODING_RAW;
+		} else {
+			it->val.encoding = ENCODING_INT;
+		}
 	}
+	if (it->expire != -1)
+		db->expires[itemExpiresIndex(it)] = newit;
+	dictReplaceEntry(db->dict, de, &newit->de);
+	return 1;
 }
 
 long long emptyDb(memoryDb *db, void (callback)(void*)) {
-	int j;
 	long long removed = 0;
 
-	removed += dictSize(db.dict);
-	dictEmpty(db.dict, callback);
-	dictEmpty(db.expires, callback);
+	removed += dictSize(db->dict);
+	dictEmpty(db->dict, callback);
+	zfree(db->expires);
+	db->expires = NULL;
+	db->expires_count = db->expires_size = 0;
 	return removed;
 }
 
@@ -274,52 +1176,114 @@ long long emptyDb(memoryDb *db, void (callback)(void*)) {
  * Expires API
  *----------------------------------------------------------------------------*/
 
-int removeExpire(memoryDb *db, sds *key) {
+/* The expire time is stored in the item, while db->expires only lists
+ * the volatile items, see createItem(). */
+int removeExpire(memoryDb *db, const char *k, size_t klen) {
+	dictEntry *de;
+	item *it;
+
 	/* An expire may only be removed if there is a corresponding entry in the
 	 * main dict. Otherwise, the key will never be freed. */
-	redisAssertWithInfo(NULL, key, dictFind(db->dict, key) != NULL);
-	return dictDelete(db->expires, key) == DICT_OK;
+	de = dbFind(db, k, klen, keyHash(k, klen));
+	redisAssertWithInfo(NULL, NULL, de != NULL);
+	it = entryItem(de);
+	if (it->expire == -1)
+		return 0;
+	expiresRemove(db, it);
+	__atomic_store_n(&it->expire, -1, __ATOMIC_RELAXED);
+	return 1;
 }
 
-void setExpire(memoryDb *db, sds *key, long long when) {
-	dictEntry *kde, *de;
+void setExpire(memoryDb *db, const char *k, size_t klen, long long when) {
+	dictEntry *kde;
+	item *it;
 
-	/* Reuse the sds from the main dict in the expire dict */
-	kde = dictFind(db->dict, key);
-	redisAssertWithInfo(NULL, key, kde != NULL);
-	de = dictReplaceRaw(db->expires, dictGetKey(kde));
-	dictSetSignedIntegerVal(de, when);
+	kde = dbFind(db, k, klen, keyHash(k, klen));
+	redisAssertWithInfo(NULL, NULL, kde != NULL);
+	it = entryItem(kde);
+	if (it->expire == -1)
+		expiresAdd(db, it);
+	__atomic_store_n(&it->expire, when, __ATOMIC_RELAXED);
 }
 
 /* Return the expire time of the specified key, or -1 if no expire
  * is associated with this key (i.e. the key is non volatile) */
-long long getExpire(memoryDb *db, sds *key) {
+long long getExpire(memoryDb *db, const char *k, size_t klen) {
 	dictEntry *de;
 
 	/* No expire? return ASAP */
-	if (dictSize(db->expires) == 0 || (de = dictFind(db->expires, key)) == NULL)
+	if (db->expires_count == 0
+			|| (de = dbFind(db, k, klen, keyHash(k, klen))) == NULL)
 		return -1;
 
-	/* The entry was found in the expire dict, this means it should also
-	 * be present in the main dict (safety check). */
-	redisAssertWithInfo(NULL, key, dictFind(db->dict, key) != NULL);
-	return dictGetSignedIntegerVal(de);
+	return entryItem(de)->expire;
 }
 
-int expireIfNeeded(memoryDb *db, sds *key) {
-	mstime_t when = getExpire(db, key);
-	mstime_t now;
-
-	if (when < 0)
+/* Delete the item if its time to live elapsed. Returns 1 if the item was
+ * deleted. */
+int itemExpireIfNeeded(memoryDb *db, item *it) {
+	if (it->expire < 0)
 		return 0; /* No expire for this key */
 
 	/* Return when this key has not expired */
-	if (now <= when)
+	if (cachedMstime() <= it->expire)
 		return 0;
 
 	/* Delete the key */
-	stats.expiredkeys++;
+	db->stats.expiredkeys++;
+	db->stats.expiredkeys_lazy++;
+
+	return dbDeleteItem(db, it);
+}
 
-	return dbDelete(db, key);
+int expireIfNeeded(memoryDb *db, const char *k, size_t klen) {
+	dictEntry *de;
+
+	if (db->expires_count == 0
+			|| (de = dbFind(db, k, klen, keyHash(k, klen))) == NULL)
+		return 0;
+	return itemExpireIfNeeded(db, entryItem(de));
 }
 
+
+/* Try to delete the expired keys that are never accessed again, sampling
+ * random keys from db->expires for at most 'us' microseconds.
+ *
+ * Keys are sampled ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP at a time, and we
+ * keep sampling as long as more than ACTIVE_EXPIRE_CYCLE_ACCEPTABLE_STALE
+ * percent of a sample was expired: the effort adapts to the amount of
+ * memory used by expired keys, while a DB with few of them costs a single
+ * sample. Returns the number of deleted keys. */
+long activeExpireCycle(memoryDb *db, long long us) {
+	long long start = ustime();
+	mstime_t now = cachedMstime();
+	long expired, total = 0;
+	int iteration = 0;
+
+	do {
+		unsigned long num = db->expires_count;
+
+		if (num > ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP)
+			num = ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP;
+		expired = 0;
+		while (num-- && db->expires_count) {
+			item *it = db->expires[random() % db->expires_count];
+
+			if (now > it->expire) {
+				db->stats.expiredkeys++;
+				db->stats.expiredkeys_active++;
+				dbDeleteItem(db, it);
+				expired++;
+			}
+		}
+		total += expired;
+
+		/* We can't block forever here even if there are many keys to
+		 * expire, so check the time every 16 iterations. */
+		if ((++iteration & 0xf) == 0 && ustime() - start > us)
+			break;
+	} while (expired > ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP
+			* ACTIVE_EXPIRE_CYCLE_ACCEPTABLE_STALE / 100);
+	db->stats.expire_cycle_time += ustime() - start;
+	return total;
+}
@@ -2,37 +2,281 @@
 #define _DB_H_
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
 #include <limits.h>
+#include <assert.h>
+#include <pthread.h>
 
 typedef long long mstime_t; /* millisecond time type. */
 
 #include "stats.h"
 #include "dict.h"
+#include "sds.h"
+#include "zmalloc.h"
+#include "util.h"
+#include "slabs.h"
+#include "rope.h"
 
 #define MDB_OK   0
 #define MDB_ERR  1
 
+/* mdb has no client and debug layers, assertions just abort. */
+#define redisAssertWithInfo(_c,_o,_e) assert(_e)
+#define panic(_e) do { fprintf(stderr, "PANIC: %s\n", _e); abort(); } while(0)
+
+/* A DB is a slot of the keyspace. All the keys of a slot are modified
+ * while holding its lock. */
 typedef struct memoryDb {
 	dict *dict; /* The keyspace for this DB */
-	dict *expires; /* Timeout of keys with a timeout set */
-	dict **slots;
+	struct item **expires; /* Keys with a timeout set, in no particular order */
+	unsigned long expires_count, expires_size;
+	struct evictionPoolEntry *eviction_pool; /* Eviction candidates */
+	struct frequencySketch *sketch; /* Admission filter, NULL if disabled */
+	pthread_mutex_t lock;
+	stats_t stats;
+	int id;
+	int flags;
+	int arena; /* zmalloc arena of the slot, see DB_ARENAS */
+	size_t compress_min_len; /* Values compressed from this length, 0 never */
 }memoryDb;
 
-#define ENCODING_RAW 0
-#define ENCODING_INT 1
+/* DB flags */
+#define DB_CONCURRENT (1<<0) /* Readers don't take the lock, see get() */
+#define DB_ARENAS (1<<1) /* The slot allocates from its own arena */
+#define DB_ROPES (1<<2) /* Large values grow as ropes, see ENCODING_ROPE */
+
+#define ENCODING_RAW 0    /* Raw sds string, allocated out of the item */
+#define ENCODING_INT 1    /* Integer stored in the ptr field */
+#define ENCODING_EMBSTR 2 /* sds string embedded in the item */
+#define ENCODING_TINY 3   /* Short string stored in the ptr field */
+#define ENCODING_ROPE 4   /* Rope (see rope.h), allocated out of the item */
+#define ENCODING_COMPRESSED 5 /* LZ4 block, allocated out of the item */
+
+/* With DB_ROPES values of at least this length are converted to ropes when
+ * appended or prepended to. Ropes are only used when the items are not
+ * shared with readers not holding the lock (see dbItemsShared()), since
+ * they are modified in place, and they are flattened back to a raw sds
+ * string when a contiguous read is needed, see valueString(). */
+#define VALUE_ROPE_MIN_LEN ROPE_SEGMENT_SIZE
+
+/* Values of at least db->compress_min_len bytes are stored compressed, if
+ * that saves at least 1/VALUE_COMPRESS_MIN_SAVING of their size. They are
+ * decompressed at every read, see valueToSds() and valueString(). */
+#define VALUE_COMPRESS_MIN_LEN 64 /* Smallest db->compress_min_len */
+#define VALUE_COMPRESS_MIN_SAVING 8
+
+/* The payload of an ENCODING_COMPRESSED value. */
+typedef struct compressedValue {
+	uint32_t len; /* Length of the value */
+	uint32_t clen; /* Length of the compressed block */
+	char data[];
+} compressedValue;
+
+/* Strings up to this length, with no null bytes, are stored in the ptr
+ * field of the value, null terminated. Use valueToSds() or valueLen()
+ * rather than reading the field. */
+#define VALUE_TINY_MAX_LEN (sizeof(void*) - 1)
+
+/* Room for the string of an integer or tiny value, see valueString(). */
+#define VALUE_STR_BUF_SIZE 24
+
+/* Active expire cycle, see activeExpireCycle() */
+#define ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP 20 /* Keys sampled per loop */
+#define ACTIVE_EXPIRE_CYCLE_ACCEPTABLE_STALE 25 /* % of expired keys to stop */
+
+/* Eviction policies, see evict.c */
+#define MAXMEMORY_FLAG_LRU (1<<0)
+#define MAXMEMORY_FLAG_LFU (1<<1)
+#define MAXMEMORY_FLAG_ALLKEYS (1<<2)
+
+#define MAXMEMORY_VOLATILE_LRU ((0<<8)|MAXMEMORY_FLAG_LRU)
+#define MAXMEMORY_VOLATILE_LFU ((1<<8)|MAXMEMORY_FLAG_LFU)
+#define MAXMEMORY_VOLATILE_TTL (2<<8)
+#define MAXMEMORY_ALLKEYS_LRU ((4<<8)|MAXMEMORY_FLAG_LRU|MAXMEMORY_FLAG_ALLKEYS)
+#define MAXMEMORY_ALLKEYS_LFU ((5<<8)|MAXMEMORY_FLAG_LFU|MAXMEMORY_FLAG_ALLKEYS)
+#define MAXMEMORY_NO_EVICTION (7<<8)
+
+#define MAXMEMORY_SAMPLES 5 /* Keys sampled to refill the eviction pool */
+#define EVPOOL_SIZE 16 /* Candidates kept in the eviction pool */
+
+/* The LRU clock is the cached time in milliseconds truncated to 32 bits.
+ * It wraps every ~49 days, idle times are computed modulo 2^32. */
+#define LRU_CLOCK() ((unsigned) cachedMstime())
+
+/* With the LFU policies the lru field of values holds instead the time of
+ * the last decrement in minutes (16 bits) and a logarithmic access counter
+ * (8 bits), see evict.c. */
+#define LFU_INIT_VAL 5 /* Counter of new keys, so they are not evicted at once */
+#define LFU_LOG_FACTOR 10 /* Default lfu_log_factor */
+#define LFU_DECAY_TIME 1 /* Default lfu_decay_time, in minutes */
+
+/* Count-min sketch estimating the access frequency of keys, used for the
+ * TinyLFU admission filter. */
+#define FREQ_SKETCH_DEPTH 4 /* Rows of counters */
+#define FREQ_SKETCH_MIN_WIDTH 64 /* Counters per row at least */
+#define FREQ_SKETCH_SAMPLE_FACTOR 10 /* Halve counters every width*10 adds */
+
+typedef struct frequencySketch {
+	unsigned char *table; /* FREQ_SKETCH_DEPTH rows of 'width' counters */
+	unsigned long width;
+	unsigned long additions; /* Increments since the last halving */
+	unsigned long sample_size;
+} frequencySketch;
+
+/* Values up to this size are embedded in the item. */
+#define ITEM_EMBSTR_SIZE_LIMIT 64
+
+/* Keys up to ITEM_INLINE_KEY_LEN bytes are padded with zeros to that
+ * length, so that the sds header and the string take ITEM_INLINE_KEY_SIZE
+ * bytes and two keys are compared as a single block. The padding is the
+ * free space of the sds, so a padded key has sdslen()+sdsavail() equal to
+ * ITEM_INLINE_KEY_LEN. See embedKey() and dictItemKeyCompare(). */
+#define ITEM_INLINE_KEY_LEN 23
+#define ITEM_INLINE_KEY_SIZE (sizeof(struct sdshdr) + ITEM_INLINE_KEY_LEN + 1)
+
+/* Keys up to this length are looked up with no allocation, see keyBuf in
+ * db.c. It is the longest key memcached accepts. */
+#define KEY_STACK_LEN 250
 
 typedef struct value_s {
 	unsigned encoding:4;
-	unsigned ver:28;
+	unsigned lru; /* LRU_CLOCK() at the last access, or LFU data */
+	uint64_t cas; /* Unique id of the last write, see nextCasId() */
 	void *ptr;
 } value_t;
 
-value_t *createValue(unsigned encoding, void *p);
-value_t *createValueFromStr(void *p, size_t len);
-value_t *createValueFromLongLong(long long v);
-void freeValue(value_t *val);
+/* dbCompareAndSet() results */
+#define DB_CAS_STORED 0
+#define DB_CAS_EXISTS 1 /* The key was written since the CAS id was read */
+#define DB_CAS_NOT_FOUND 2
+
+/* An item is how a key is stored in the keyspace: the dict entry, the
+ * expire time, the value header, the key and, if small enough, the value
+ * itself share a single allocation:
+ *
+ * +-----------+--------+---------+----------+---------------------+
+ * | dictEntry | expire | value_t | key sds  | value sds (EMBSTR)  |
+ * +-----------+--------+---------+----------+---------------------+
+ *
+ * The dict entry is the first field, so when the key is deleted the dict
+ * frees the whole item. The key is an sds built in place, and it is never
+ * modified or freed on its own: the dict key destructor is used to release
+ * the item. Short keys are padded, see ITEM_INLINE_KEY_LEN. Values that
+ * don't fit in the space left at the end of the allocation are stored out
+ * of line (ENCODING_RAW).
+ *
+ * The expire time is checked as soon as the key is found, with no further
+ * lookup. db->expires is only used to find the keys to purge: it is an
+ * array of the volatile items. Since the value is in the item, the value
+ * field of the dict entry is free to store the index of the item in
+ * db->expires. */
+typedef struct item {
+	dictEntry de;
+	mstime_t expire; /* Unix time in milliseconds, -1 if not volatile */
+	value_t val;
+	char data[];
+} item;
+
+#define entryItem(de) ((item*) (de))
+#define valueItem(v) ((item*) ((char*) (v) - offsetof(item, val)))
+#define keyItem(k) ((item*) ((char*) (k) - sizeof(struct sdshdr) \
+		- offsetof(item, data)))
+#define itemKey(it) ((sds) ((it)->de.key))
+#define itemExpiresIndex(it) ((it)->de.v.u64)
+
+memoryDb *memoryDbNew(int id, int engine, int flags);
+long long ustime(void);
+mstime_t mstime(void);
+void updateCachedTime(void);
+void setPreciseClock(int precise);
+mstime_t cachedMstime(void);
+
+item *createItem(memoryDb *db, const char *k, size_t klen, const char *v,
+		size_t len);
+void itemSetValue(memoryDb *db, item *it, const char *v, size_t len);
+void freeValuePayload(value_t *val);
 int getLongLongFromValue(value_t *val, long long *ret);
+value_t *toStringValue(value_t *val);
+sds valueToSds(value_t *val);
+const char *valueString(value_t *val, char *buf, size_t *len, sds *copy);
+size_t valueLen(value_t *val);
+int valueIovec(value_t *val, struct iovec *iov, int max, char *buf,
+		sds *copy);
+size_t valueAppend(memoryDb *db, value_t *val, const char *s, size_t len,
+		int prepend);
+uint64_t nextCasId(void);
+uint64_t valueCas(value_t *val);
+void getCompressionStats(stats_t *st);
+
+int dbItemsShared(memoryDb *db);
+value_t *lookupKey(memoryDb *db, const char *k, size_t klen);
+value_t *lookupKeyRead(memoryDb *db, const char *k, size_t klen);
+value_t *lookupKeyReadWithHash(memoryDb *db, const char *k, size_t klen,
+		uint64_t h);
+value_t *lookupKeyReadConcurrent(memoryDb *db, const char *k, size_t klen);
+value_t *lookupKeyReadConcurrentWithHash(memoryDb *db, const char *k,
+		size_t klen, uint64_t h);
+value_t *lookupKeyWrite(memoryDb *db, const char *k, size_t klen);
+void dbAdd(memoryDb *db, const char *k, size_t klen, const char *v,
+		size_t len);
+void dbOverwrite(memoryDb *db, const char *k, size_t klen, const char *v,
+		size_t len);
+void setKey(memoryDb *db, const char *k, size_t klen, const char *v,
+		size_t len);
+void setKeyWithHash(memoryDb *db, const char *k, size_t klen, uint64_t h,
+		const char *v, size_t len, long long when);
+int dbCompareAndSet(memoryDb *db, const char *k, size_t klen, uint64_t h,
+		const char *v, size_t len, long long when, uint64_t cas);
+int dbCompareCasConcurrent(memoryDb *db, const char *k, size_t klen,
+		uint64_t h, uint64_t cas);
+int dbIncrBy(memoryDb *db, const char *k, size_t klen, uint64_t h,
+		long long incr, long long *result);
+int dbExists(memoryDb *db, const char *k, size_t klen);
+int dbDelete(memoryDb *db, const char *k, size_t klen);
+int dbMoveItem(memoryDb *db, item *it);
+long long emptyDb(memoryDb *db, void (callback)(void*));
+int removeExpire(memoryDb *db, const char *k, size_t klen);
+void setExpire(memoryDb *db, const char *k, size_t klen, long long when);
+long long getExpire(memoryDb *db, const char *k, size_t klen);
+int expireIfNeeded(memoryDb *db, const char *k, size_t klen);
+int itemExpireIfNeeded(memoryDb *db, item *it);
+long activeExpireCycle(memoryDb *db, long long us);
+size_t itemMemoryUsage(item *it);
+
+/* snapshot.c */
+typedef struct snapshotInfo {
+	long long keys; /* Keys written */
+	long long bytes; /* Size of the file */
+	long long time; /* Microseconds spent writing it */
+	long long cow; /* Bytes copied on write meanwhile, see bgsave() */
+} snapshotInfo;
+
+typedef void (snapshotLoadFunction)(void *privdata, const char *k,
+		size_t klen, const char *v, size_t len, long long when);
+
+int snapshotSave(memoryDb **dbs, int count, const char *filename,
+		snapshotInfo *info);
+int snapshotLoad(const char *filename, snapshotLoadFunction *fn,
+		void *privdata, long long *keys);
+
+/* evict.c */
+extern int maxmemory_policy;
+extern int lfu_log_factor;
+extern int lfu_decay_time;
+
+void evictionPoolInit(memoryDb *db);
+unsigned valueAccessInit(void);
+void valueTouch(value_t *val);
+unsigned long valueLFUCounter(value_t *val);
+size_t evictKeys(memoryDb *db, int policy, size_t tofree, long *maxkeys,
+		long admitfreq);
+frequencySketch *sketchNew(unsigned long width);
+void sketchFree(frequencySketch *s);
+void sketchIncrement(frequencySketch *s, uint64_t hash);
+unsigned int sketchEstimate(frequencySketch *s, uint64_t hash);
 
 #endif
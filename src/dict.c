@@ -47,6 +47,10 @@
 #include "zmalloc.h"
 #include "assert.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 /* Using dictEnableResize() / dictDisableResize() we make possible to
  * enable/disable resizing of the hash table as needed. This is very important
  * for Redis, as we use copy-on-write and don't want to move too much memory
@@ -62,8 +66,18 @@ static unsigned int dict_force_resize_ratio = 5;
 
 static int _dictExpandIfNeeded(dict *ht);
 static unsigned long _dictNextPower(unsigned long size);
-static int _dictKeyIndex(dict *ht, const void *key);
-static int _dictInit(dict *ht, dictType *type, void *privDataPtr);
+static long _dictKeyIndex(dict *ht, const void *key, uint64_t *hash);
+static int _dictInit(dict *ht, dictType *type, void *privDataPtr, int engine);
+static long _dictOpenLookup(dict *d, dictht *ht, const void *key, uint64_t h);
+static long _dictOpenFreeSlot(dictht *ht, uint64_t h);
+static void _dictOpenSetSlot(dictht *ht, long slot, dictEntry *de, uint64_t h);
+static void _dictOpenClearSlot(dictht *ht, long slot);
+static dictEntry *_dictAddRaw(dict *d, void *key, dictEntry *entry);
+static dictEntry *_dictOpenAddRaw(dict *d, void *key, dictEntry *entry);
+static int _dictOpenMakeRoom(dict *d);
+static void _dictOpenGrow(dict *d);
+static unsigned long _dictCapacity(dict *d, unsigned long size);
+static void _dictInsert(dict *d, dictEntry *entry, uint64_t h);
 
 /* -------------------------- hash functions -------------------------------- */
 
@@ -79,104 +93,341 @@ unsigned int dictIntHashFunction(unsigned int key)
     return key;
 }
 
-static uint32_t dict_hash_function_seed = 5381;
+static uint64_t dict_hash_function_seed = 5381;
 
-void dictSetHashFunctionSeed(uint32_t seed) {
+void dictSetHashFunctionSeed(uint64_t seed) {
     dict_hash_function_seed = seed;
 }
 
-uint32_t dictGetHashFunctionSeed(void) {
+uint64_t dictGetHashFunctionSeed(void) {
     return dict_hash_function_seed;
 }
 
-/* MurmurHash2, by Austin Appleby
- * Note - This code makes a few assumptions about how your machine behaves -
- * 1. We can read a 4-byte value from any address without crashing
- * 2. sizeof(int) == 4
+/* 64 bit hash based on wyhash, by Wang Yi (public domain).
  *
- * And it has a few limitations -
+ * Every step multiplies two 64 bit words into a 128 bit product and folds
+ * it, so 16 bytes are mixed per multiplication. Keys longer than 48 bytes
+ * are processed in three independent lanes of 16 bytes, that the CPU can
+ * run in parallel. Keys up to 16 bytes, the common case, take a single
+ * multiplication plus the final mix.
  *
- * 1. It will not work incrementally.
- * 2. It will not produce the same results on little-endian and big-endian
- *    machines.
- */
-unsigned int dictGenHashFunction(const void *key, int len) {
-    /* 'm' and 'r' are mixing constants generated offline.
-     They're not really 'magic', they just happen to work well.  */
-    uint32_t seed = dict_hash_function_seed;
-    const uint32_t m = 0x5bd1e995;
-    const int r = 24;
+ * Like MurmurHash2 before it, the hash is not the same on little-endian and
+ * big-endian machines. */
+static const uint64_t _wyp[4] = {
+    0xa0761d6478bd642full, 0xe7037ed1a0b428dbull,
+    0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull
+};
 
-    /* Initialize the hash to a 'random' value */
-    uint32_t h = seed ^ len;
+static inline void _wymum(uint64_t *a, uint64_t *b) {
+#if defined(__SIZEOF_INT128__)
+    __uint128_t r = (__uint128_t)*a * *b;
+
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha*hb, rm0 = ha*lb, rm1 = hb*la, rl = la*lb;
+    uint64_t t = rl+(rm0 << 32), c = t < rl, lo, hi;
+
+    lo = t+(rm1 << 32);
+    c += lo < t;
+    hi = rh+(rm0 >> 32)+(rm1 >> 32)+c;
+    *a = lo;
+    *b = hi;
+#endif
+}
 
-    /* Mix 4 bytes at a time into the hash */
-    const unsigned char *data = (const unsigned char *)key;
+static inline uint64_t _wymix(uint64_t a, uint64_t b) {
+    _wymum(&a,&b);
+    return a^b;
+}
 
-    while(len >= 4) {
-        uint32_t k = *(uint32_t*)data;
+static inline uint64_t _wyr8(const unsigned char *p) {
+    uint64_t v;
 
-        k *= m;
-        k ^= k >> r;
-        k *= m;
+    memcpy(&v,p,8);
+    return v;
+}
 
-        h *= m;
-        h ^= k;
+static inline uint64_t _wyr4(const unsigned char *p) {
+    uint32_t v;
 
-        data += 4;
-        len -= 4;
-    }
-
-    /* Handle the last few bytes of the input array  */
-    switch(len) {
-    case 3: h ^= data[2] << 16;
-    case 2: h ^= data[1] << 8;
-    case 1: h ^= data[0]; h *= m;
-    };
+    memcpy(&v,p,4);
+    return v;
+}
 
-    /* Do a few final mixes of the hash to ensure the last few
-     * bytes are well-incorporated. */
-    h ^= h >> 13;
-    h *= m;
-    h ^= h >> 15;
+static inline uint64_t _wyr3(const unsigned char *p, size_t k) {
+    return (((uint64_t)p[0]) << 16) | (((uint64_t)p[k >> 1]) << 8) | p[k-1];
+}
 
-    return (unsigned int)h;
+uint64_t dictGenHashFunction(const void *key, int len) {
+    const unsigned char *p = key;
+    uint64_t seed = dict_hash_function_seed, a, b;
+    size_t i = len;
+
+    seed ^= _wymix(seed^_wyp[0],_wyp[1]);
+    if (i <= 16) {
+        if (i >= 4) {
+            a = (_wyr4(p) << 32) | _wyr4(p+((i >> 3) << 2));
+            b = (_wyr4(p+i-4) << 32) | _wyr4(p+i-4-((i >> 3) << 2));
+        } else if (i > 0) {
+            a = _wyr3(p,i);
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+
+            do {
+                seed = _wymix(_wyr8(p)^_wyp[1],_wyr8(p+8)^seed);
+                see1 = _wymix(_wyr8(p+16)^_wyp[2],_wyr8(p+24)^see1);
+                see2 = _wymix(_wyr8(p+32)^_wyp[3],_wyr8(p+40)^see2);
+                p += 48;
+                i -= 48;
+            } while(i > 48);
+            seed ^= see1^see2;
+        }
+        while(i > 16) {
+            seed = _wymix(_wyr8(p)^_wyp[1],_wyr8(p+8)^seed);
+            i -= 16;
+            p += 16;
+        }
+        a = _wyr8(p+i-16);
+        b = _wyr8(p+i-8);
+    }
+    a ^= _wyp[1];
+    b ^= seed;
+    _wymum(&a,&b);
+    return _wymix(a^_wyp[0]^(uint64_t)len,b^_wyp[1]);
 }
 
 /* And a case insensitive hash function (based on djb hash) */
-unsigned int dictGenCaseHashFunction(const unsigned char *buf, int len) {
-    unsigned int hash = (unsigned int)dict_hash_function_seed;
+uint64_t dictGenCaseHashFunction(const unsigned char *buf, int len) {
+    uint64_t hash = dict_hash_function_seed;
 
     while (len--)
         hash = ((hash << 5) + hash) + (tolower(*buf++)); /* hash * 33 + c */
     return hash;
 }
 
+/* --------------------------- concurrent readers --------------------------- */
+
+/* When concurrent readers are enabled (see dictEnableConcurrentReaders())
+ * dictFindConcurrent() may run while the thread owning the dict modifies
+ * it. Writers publish pointers with release stores, once the memory they
+ * point to is initialized, and memory that may still be reachable by a
+ * reader (entries and tables) is handed to d->reclaim instead of being
+ * freed.
+ *
+ * Adding or deleting entries never hides the other entries from readers,
+ * but moving entries from the old to the new table while rehashing does:
+ * this is done between _dictBeginMove() and _dictEndMove(), and lookups
+ * that miss are retried if d->rehashseq changed meanwhile.
+ *
+ * The control bytes of open addressing tables are read with plain (vector)
+ * loads: a stale control byte only makes a reader check a slot it could
+ * skip or the other way around, while slots are loaded atomically. */
+#define _dictLoad(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define _dictStore(p,v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+/* Every table is preceded by its sizemask, and open addressing tables are
+ * followed by their control bytes. */
+#define _dictTableMask(t) (((unsigned long*)(t))[-1])
+#define _dictTableCtrl(t) ((unsigned char*)((t)+_dictTableMask(t)+1))
+
+static void _dictFreeMem(dict *d, void *ptr) {
+    if (d->reclaim)
+        d->reclaim(ptr, zfree);
+    else
+        zfree(ptr);
+}
+
+/* Like _dictFreeMem() for entries, that the type may allocate itself. */
+static void _dictFreeEntry(dict *d, dictEntry *he) {
+    void (*freefn)(void *ptr) = d->type->entryFree ? d->type->entryFree : zfree;
+
+    if (d->reclaim)
+        d->reclaim(he, freefn);
+    else
+        freefn(he);
+}
+
+static void _dictFreeTable(dict *d, dictht *ht) {
+    if (ht->table) _dictFreeMem(d, (unsigned long*)ht->table-1);
+}
+
+static void _dictBeginMove(dict *d) {
+    __atomic_store_n(&d->rehashseq, d->rehashseq+1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void _dictEndMove(dict *d) {
+    __atomic_store_n(&d->rehashseq, d->rehashseq+1, __ATOMIC_RELEASE);
+}
+
+/* Install the table 'n' as 'ht'. Readers only look at the table pointer,
+ * that is stored last. */
+static void _dictInstall(dictht *ht, dictht *n) {
+    ht->ctrl = n->ctrl;
+    ht->size = n->size;
+    ht->sizemask = n->sizemask;
+    ht->used = n->used;
+    ht->deleted = n->deleted;
+    _dictStore(ht->table, n->table);
+}
+
+/* ----------------------- open addressing primitives ----------------------- */
+
+/* Every slot of an open addressing table has a control byte. Free slots have
+ * the high bit set, while used slots store the low 7 bits of the key hash
+ * (H2), so that most of the non matching slots are skipped without touching
+ * the entry. The remaining bits of the hash (H1) select the home group
+ * of the key, and groups are then probed linearly. */
+#define DICT_CTRL_EMPTY 0x80
+#define DICT_CTRL_DELETED 0xfe
+
+#define _dictH1(h) ((h) >> 7)
+#define _dictH2(h) ((unsigned char)((h) & 0x7f))
+#define _dictGroupMask(ht) ((ht)->size/DICT_GROUP_SIZE-1)
+
+#if defined(__SSE2__)
+/* Return a bitmap of the slots of the group having control byte 'c'. */
+static inline unsigned int _dictGroupMatch(const unsigned char *ctrl,
+        unsigned char c)
+{
+    __m128i group = _mm_loadu_si128((const __m128i*)ctrl);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group,_mm_set1_epi8((char)c)));
+}
+
+/* Return a bitmap of the empty or deleted slots of the group. */
+static inline unsigned int _dictGroupMatchFree(const unsigned char *ctrl) {
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)ctrl));
+}
+#else
+static inline unsigned int _dictGroupMatch(const unsigned char *ctrl,
+        unsigned char c)
+{
+    unsigned int j, mask = 0;
+
+    for (j = 0; j < DICT_GROUP_SIZE; j++)
+        if (ctrl[j] == c) mask |= 1u << j;
+    return mask;
+}
+
+static inline unsigned int _dictGroupMatchFree(const unsigned char *ctrl) {
+    unsigned int j, mask = 0;
+
+    for (j = 0; j < DICT_GROUP_SIZE; j++)
+        if (ctrl[j] & 0x80) mask |= 1u << j;
+    return mask;
+}
+#endif
+
+/* Return the slot of 'key' in the open addressing table 'ht', or -1 if the
+ * key is not there. Probing stops at the first group with an empty slot. */
+static long _dictOpenLookup(dict *d, dictht *ht, const void *key,
+        uint64_t h)
+{
+    unsigned long g, gmask, probes;
+    unsigned char h2 = _dictH2(h);
+
+    if (ht->size == 0) return -1;
+    gmask = _dictGroupMask(ht);
+    g = _dictH1(h) & gmask;
+    for (probes = 0; probes <= gmask; probes++) {
+        const unsigned char *ctrl = ht->ctrl+g*DICT_GROUP_SIZE;
+        unsigned int match = _dictGroupMatch(ctrl,h2);
+
+        while(match) {
+            long slot = g*DICT_GROUP_SIZE+__builtin_ctz(match);
+
+            if (dictEntryMatches(d, ht->table[slot], key, h))
+                return slot;
+            match &= match-1;
+        }
+        if (_dictGroupMatch(ctrl,DICT_CTRL_EMPTY)) break;
+        g = (g+1) & gmask;
+    }
+    return -1;
+}
+
+/* Return the first empty or deleted slot in the probe sequence of 'h'.
+ * The caller must make sure the table is not full. */
+static long _dictOpenFreeSlot(dictht *ht, uint64_t h) {
+    unsigned long gmask = _dictGroupMask(ht);
+    unsigned long g = _dictH1(h) & gmask;
+
+    while(1) {
+        unsigned int match = _dictGroupMatchFree(ht->ctrl+g*DICT_GROUP_SIZE);
+
+        if (match) return g*DICT_GROUP_SIZE+__builtin_ctz(match);
+        g = (g+1) & gmask;
+    }
+}
+
+static void _dictOpenSetSlot(dictht *ht, long slot, dictEntry *de,
+        uint64_t h)
+{
+    if (ht->ctrl[slot] == DICT_CTRL_DELETED) ht->deleted--;
+    _dictStore(ht->table[slot], de);
+    ht->ctrl[slot] = _dictH2(h);
+    ht->used++;
+}
+
+/* Release a slot. If its group still has an empty slot no probe sequence
+ * can go past this group, so the slot can be marked as empty as well.
+ * Otherwise we need a tombstone to keep the following keys reachable. */
+static void _dictOpenClearSlot(dictht *ht, long slot) {
+    const unsigned char *group = ht->ctrl+(slot & ~(long)(DICT_GROUP_SIZE-1));
+
+    if (_dictGroupMatch(group,DICT_CTRL_EMPTY)) {
+        ht->ctrl[slot] = DICT_CTRL_EMPTY;
+    } else {
+        ht->ctrl[slot] = DICT_CTRL_DELETED;
+        ht->deleted++;
+    }
+    _dictStore(ht->table[slot], NULL);
+    ht->used--;
+}
+
 /* ----------------------------- API implementation ------------------------- */
 
 /* Reset a hash table already initialized with ht_init().
  * NOTE: This function should only be called by ht_destroy(). */
 static void _dictReset(dictht *ht)
 {
-    ht->table = NULL;
+    _dictStore(ht->table, NULL);
+    ht->ctrl = NULL;
     ht->size = 0;
     ht->sizemask = 0;
     ht->used = 0;
+    ht->deleted = 0;
 }
 
 /* Create a new hash table */
 dict *dictCreate(dictType *type,
         void *privDataPtr)
+{
+    return dictCreateWithEngine(type,privDataPtr,DICT_ENGINE_CHAINED);
+}
+
+/* Create a new hash table using the specified table engine, that is
+ * DICT_ENGINE_CHAINED or DICT_ENGINE_OPEN. */
+dict *dictCreateWithEngine(dictType *type,
+        void *privDataPtr, int engine)
 {
     dict *d = zmalloc(sizeof(*d));
 
-    _dictInit(d,type,privDataPtr);
+    _dictInit(d,type,privDataPtr,engine);
     return d;
 }
 
 /* Initialize the hash table */
 int _dictInit(dict *d, dictType *type,
-        void *privDataPtr)
+        void *privDataPtr, int engine)
 {
     _dictReset(&d->ht[0]);
     _dictReset(&d->ht[1]);
@@ -184,9 +435,25 @@ int _dictInit(dict *d, dictType *type,
     d->privdata = privDataPtr;
     d->rehashidx = -1;
     d->iterators = 0;
+    d->engine = engine;
+    d->reclaim = NULL;
+    d->rehashseq = 0;
     return DICT_OK;
 }
 
+/* Expand the table, if needed, so that 'n' more keys can be added without
+ * expanding it again, instead of going through several rehashings of a
+ * growing table when many keys are added. Returns DICT_ERR, doing nothing,
+ * while rehashing. */
+int dictReserve(dict *d, unsigned long n)
+{
+    unsigned long needed = d->ht[0].used+n;
+
+    if (dictIsRehashing(d)) return DICT_ERR;
+    if (needed <= _dictCapacity(d, d->ht[0].size)) return DICT_OK;
+    return dictExpand(d, needed);
+}
+
 /* Resize the table to the minimal size that contains all the elements,
  * but with the invariant of a USED/BUCKETS ratio near to <= 1 */
 int dictResize(dict *d)
@@ -200,32 +467,59 @@ int dictResize(dict *d)
     return dictExpand(d, minimal);
 }
 
+/* Number of keys a table of 'size' slots holds before it must grow. Open
+ * addressing tables always keep at least 1/8 of the slots empty (tombstones
+ * count as used slots), so that probe sequences are short and always
+ * terminate. */
+static unsigned long _dictCapacity(dict *d, unsigned long size) {
+    return dictIsOpen(d) ? size/8*7 : size;
+}
+
+/* Initialize 'n' with a new empty table able to hold 'size' keys. */
+static void _dictAllocTable(dict *d, dictht *n, unsigned long size) {
+    unsigned long realsize = _dictNextPower(size);
+    unsigned long *block;
+
+    /* Open addressing tables are made of whole groups of slots. */
+    if (dictIsOpen(d) && realsize < DICT_OPEN_INITIAL_SIZE)
+        realsize = DICT_OPEN_INITIAL_SIZE;
+    while (_dictCapacity(d, realsize) < size && realsize < LONG_MAX/2)
+        realsize *= 2;
+
+    /* Allocate the new hash table and initialize all pointers to NULL */
+    _dictReset(n);
+    n->size = realsize;
+    n->sizemask = realsize-1;
+    block = zcalloc(sizeof(unsigned long)+realsize*sizeof(dictEntry*)+
+                    (dictIsOpen(d) ? realsize : 0));
+    block[0] = n->sizemask;
+    n->table = (dictEntry**)(block+1);
+    if (dictIsOpen(d)) {
+        n->ctrl = _dictTableCtrl(n->table);
+        memset(n->ctrl,DICT_CTRL_EMPTY,realsize);
+    }
+}
+
 /* Expand or create the hash table */
 int dictExpand(dict *d, unsigned long size)
 {
     dictht n; /* the new hash table */
-    unsigned long realsize = _dictNextPower(size);
 
     /* the size is invalid if it is smaller than the number of
      * elements already inside the hash table */
     if (dictIsRehashing(d) || d->ht[0].used > size)
         return DICT_ERR;
-
-    /* Allocate the new hash table and initialize all pointers to NULL */
-    n.size = realsize;
-    n.sizemask = realsize-1;
-    n.table = zcalloc(realsize*sizeof(dictEntry*));
-    n.used = 0;
+    _dictAllocTable(d, &n, size);
 
     /* Is this the first initialization? If so it's not really a rehashing
      * we just set the first hash table so that it can accept keys. */
     if (d->ht[0].table == NULL) {
-        d->ht[0] = n;
+        _dictInstall(&d->ht[0], &n);
         return DICT_OK;
     }
 
     /* Prepare a second hash table for incremental rehashing */
-    d->ht[1] = n;
+    _dictInstall(&d->ht[1], &n);
     d->rehashidx = 0;
     return DICT_OK;
 }
@@ -242,10 +536,12 @@ int dictRehash(dict *d, int n) {
 
         /* Check if we already rehashed the whole table... */
         if (d->ht[0].used == 0) {
-            zfree(d->ht[0].table);
-            d->ht[0] = d->ht[1];
+            _dictBeginMove(d);
+            _dictFreeTable(d, &d->ht[0]);
+            _dictInstall(&d->ht[0], &d->ht[1]);
             _dictReset(&d->ht[1]);
             d->rehashidx = -1;
+            _dictEndMove(d);
             return 0;
         }
 
@@ -254,21 +550,38 @@ int dictRehash(dict *d, int n) {
         assert(d->ht[0].size > (unsigned long)d->rehashidx);
         while(d->ht[0].table[d->rehashidx] == NULL) d->rehashidx++;
         de = d->ht[0].table[d->rehashidx];
-        /* Move all the keys in this bucket from the old to the new hash HT */
+        /* Moved keys may reuse tombstones, but not fill the new table */
+        if (dictIsOpen(d) && d->ht[1].used >= _dictCapacity(d, d->ht[1].size))
+            _dictOpenGrow(d);
+        /* Open addressing slots hold a single entry: move it to the first
+         * free slot of its probe sequence in the new table. */
+        _dictBeginMove(d);
+        if (dictIsOpen(d)) {
+            uint64_t h = de->hash;
+
+            _dictOpenSetSlot(&d->ht[1], _dictOpenFreeSlot(&d->ht[1],h), de, h);
+            _dictOpenClearSlot(&d->ht[0], d->rehashidx);
+            d->rehashidx++;
+            _dictEndMove(d);
+            continue;
+        }
+        /* Move all the keys in this bucket from the old to the new hash HT.
+         * The stored hash saves calling the hash function on every key. */
         while(de) {
-            unsigned int h;
+            unsigned long h;
 
             nextde = de->next;
             /* Get the index in the new hash table */
-            h = dictHashKey(d, de->key) & d->ht[1].sizemask;
-            de->next = d->ht[1].table[h];
-            d->ht[1].table[h] = de;
+            h = de->hash & d->ht[1].sizemask;
+            _dictStore(de->next, d->ht[1].table[h]);
+            _dictStore(d->ht[1].table[h], de);
             d->ht[0].used--;
             d->ht[1].used++;
             de = nextde;
         }
-        d->ht[0].table[d->rehashidx] = NULL;
+        _dictStore(d->ht[0].table[d->rehashidx], NULL);
         d->rehashidx++;
+        _dictEndMove(d);
     }
     return 1;
 }
@@ -280,6 +593,13 @@ long long timeInMilliseconds(void) {
     return (((long long)tv.tv_sec)*1000)+(tv.tv_usec/1000);
 }
 
+long long timeInMicroseconds(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return (((long long)tv.tv_sec)*1000000)+tv.tv_usec;
+}
+
 /* Rehash for an amount of time between ms milliseconds and ms+1 milliseconds */
 int dictRehashMilliseconds(dict *d, int ms) {
     long long start = timeInMilliseconds();
@@ -292,6 +612,20 @@ int dictRehashMilliseconds(dict *d, int ms) {
     return rehashes;
 }
 
+/* Like dictRehashMilliseconds() with a finer budget: rehash until 'us'
+ * microseconds elapsed, checking the time every 100 steps. Returns the
+ * number of steps performed. */
+int dictRehashMicroseconds(dict *d, long long us) {
+    long long start = timeInMicroseconds();
+    int rehashes = 0;
+
+    while(dictRehash(d,100)) {
+        rehashes += 100;
+        if (timeInMicroseconds()-start > us) break;
+    }
+    return rehashes;
+}
+
 /* This function performs just a step of rehashing, and only if there are
  * no safe iterators bound to our hash table. When we have iterators in the
  * middle of a rehashing we can't mess with the two hash tables otherwise
@@ -331,26 +665,143 @@ int dictAdd(dict *d, void *key, void *val)
  */
 dictEntry *dictAddRaw(dict *d, void *key)
 {
-    int index;
-    dictEntry *entry;
-    dictht *ht;
+    return _dictAddRaw(d, key, NULL);
+}
+
+/* Add an entry allocated by the caller. The entry must be obtained with
+ * zmalloc() and must have the key already set (the key dup method is not
+ * called), while all the other fields are managed by the dict.
+ *
+ * This allows the caller to allocate the entry, the key and the value in
+ * a single block: the dict frees the block with zfree(), or the entryFree
+ * method of the type, when the entry is deleted, after calling the key and
+ * value destructors.
+ *
+ * If the key already exists DICT_ERR is returned and the entry is not
+ * added (the caller is still responsible of freeing it). */
+int dictAddEntry(dict *d, dictEntry *entry)
+{
+    return _dictAddRaw(d, entry->key, entry) ? DICT_OK : DICT_ERR;
+}
+
+/* Implements dictAddRaw() and dictAddEntry(). If 'entry' is NULL a new
+ * entry is allocated. */
+static dictEntry *_dictAddRaw(dict *d, void *key, dictEntry *entry)
+{
+    long index;
+    uint64_t h;
 
     if (dictIsRehashing(d)) _dictRehashStep(d);
+    if (dictIsOpen(d)) return _dictOpenAddRaw(d, key, entry);
 
     /* Get the index of the new element, or -1 if
      * the element already exists. */
-    if ((index = _dictKeyIndex(d, key)) == -1)
+    if ((index = _dictKeyIndex(d, key, &h)) == -1)
         return NULL;
 
     /* Allocate the memory and store the new entry */
-    ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
-    entry = zmalloc(sizeof(*entry));
-    entry->next = ht->table[index];
-    ht->table[index] = entry;
+    if (entry == NULL) {
+        entry = zmalloc(sizeof(*entry));
+        /* Set the hash entry fields. */
+        dictSetKey(d, entry, key);
+    }
+    _dictInsert(d, entry, h);
+    return entry;
+}
+
+/* Link the new entry in the table new keys go to, that must have room for
+ * it. */
+static void _dictInsert(dict *d, dictEntry *entry, uint64_t h)
+{
+    dictht *ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
+    unsigned long idx;
+
+    entry->hash = h;
+    if (dictIsOpen(d)) {
+        assert(ht->used < ht->size);
+        entry->next = NULL;
+        _dictOpenSetSlot(ht, _dictOpenFreeSlot(ht,h), entry, h);
+        return;
+    }
+    idx = h & ht->sizemask;
+    entry->next = ht->table[idx];
+    _dictStore(ht->table[idx], entry);
     ht->used++;
+}
+
+/* Like dictAddEntry(), for an entry whose key is known not to be in the
+ * dictionary, for instance because it was just looked up with
+ * dictFindWithHash(): the key is not looked up again. 'h' is the hash of
+ * the key. */
+int dictAddNewEntry(dict *d, dictEntry *entry, uint64_t h)
+{
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+    if (dictIsOpen(d) ? _dictOpenMakeRoom(d) : _dictExpandIfNeeded(d))
+        return DICT_ERR;
+    _dictInsert(d, entry, h);
+    return DICT_OK;
+}
+
+/* Replace the new table of a rehashing open addressing dict with a bigger
+ * one, for when it can't take the keys still in the old table: they would
+ * have no free slot to be moved to. Only the slots are copied, the entries
+ * stay where they are, so concurrent readers find them in either copy. */
+static void _dictOpenGrow(dict *d)
+{
+    dictht n;
+    unsigned long j;
+
+    _dictAllocTable(d, &n, (d->ht[0].used+d->ht[1].used)*2);
+    for (j = 0; j < d->ht[1].size; j++) {
+        dictEntry *de = d->ht[1].table[j];
+
+        if (de) _dictOpenSetSlot(&n, _dictOpenFreeSlot(&n,de->hash), de,
+                                 de->hash);
+    }
+    _dictBeginMove(d);
+    _dictFreeTable(d, &d->ht[1]);
+    _dictInstall(&d->ht[1], &n);
+    _dictEndMove(d);
+}
+
+/* Make room for a new key in an open addressing dict. */
+static int _dictOpenMakeRoom(dict *d)
+{
+    /* New keys go to the new table while rehashing. If it gets full before
+     * the old table is drained (rehashing is paused while safe iterators
+     * are running) we complete the rehashing now, when it is possible and
+     * all the keys fit, otherwise the new table is replaced by a bigger
+     * one. */
+    if (dictIsRehashing(d) && d->iterators == 0 &&
+        d->ht[1].used+d->ht[1].deleted >= _dictCapacity(d, d->ht[1].size))
+    {
+        if (d->ht[0].used+d->ht[1].used < _dictCapacity(d, d->ht[1].size))
+            while(dictRehash(d,100));
+        else
+            _dictOpenGrow(d);
+    }
+    return _dictExpandIfNeeded(d);
+}
+
+/* _dictAddRaw() for the open addressing engine. */
+static dictEntry *_dictOpenAddRaw(dict *d, void *key, dictEntry *entry)
+{
+    uint64_t h;
 
-    /* Set the hash entry fields. */
-    dictSetKey(d, entry, key);
+    if (_dictOpenMakeRoom(d) == DICT_ERR)
+        return NULL;
+
+    h = dictHashKey(d, key);
+    if (_dictOpenLookup(d, &d->ht[0], key, h) != -1) return NULL;
+    if (dictIsRehashing(d) && _dictOpenLookup(d, &d->ht[1], key, h) != -1)
+        return NULL;
+
+    if (entry == NULL) {
+        entry = zmalloc(sizeof(*entry));
+        /* Set the hash entry fields. */
+        dictSetKey(d, entry, key);
+    }
+    _dictInsert(d, entry, h);
     return entry;
 }
 
@@ -391,10 +842,49 @@ dictEntry *dictReplaceRaw(dict *d, void *key) {
     return entry ? entry : dictAddRaw(d,key);
 }
 
+/* Replace the entry 'oldde' with 'newde', that must have the same key,
+ * then release 'oldde' as dictDelete() does. Concurrent readers find either
+ * the old or the new entry. Like dictAddEntry() 'newde' must be allocated
+ * by the caller with its key set.
+ *
+ * Return DICT_ERR if 'oldde' is not in the dictionary. */
+int dictReplaceEntry(dict *d, dictEntry *oldde, dictEntry *newde)
+{
+    uint64_t h = oldde->hash;
+    int table;
+
+    newde->hash = h;
+    for (table = 0; table <= 1; table++) {
+        dictht *ht = &d->ht[table];
+
+        if (ht->size == 0) break;
+        if (dictIsOpen(d)) {
+            long slot = _dictOpenLookup(d, ht, oldde->key, h);
+
+            if (slot == -1 || ht->table[slot] != oldde) continue;
+            newde->next = NULL;
+            _dictStore(ht->table[slot], newde);
+        } else {
+            dictEntry **pp = &ht->table[h & ht->sizemask];
+
+            while(*pp && *pp != oldde) pp = &(*pp)->next;
+            if (*pp == NULL) continue;
+            newde->next = oldde->next;
+            _dictStore(*pp, newde);
+        }
+        dictFreeKey(d, oldde);
+        dictFreeVal(d, oldde);
+        _dictFreeEntry(d, oldde);
+        return DICT_OK;
+    }
+    return DICT_ERR;
+}
+
 /* Search and remove an element */
 static int dictGenericDelete(dict *d, const void *key, int nofree)
 {
-    unsigned int h, idx;
+    uint64_t h;
+    unsigned long idx;
     dictEntry *he, *prevHe;
     int table;
 
@@ -403,21 +893,37 @@ static int dictGenericDelete(dict *d, const void *key, int nofree)
     h = dictHashKey(d, key);
 
     for (table = 0; table <= 1; table++) {
+        if (dictIsOpen(d)) {
+            long slot = _dictOpenLookup(d, &d->ht[table], key, h);
+
+            if (slot != -1) {
+                he = d->ht[table].table[slot];
+                _dictOpenClearSlot(&d->ht[table], slot);
+                if (!nofree) {
+                    dictFreeKey(d, he);
+                    dictFreeVal(d, he);
+                }
+                _dictFreeEntry(d, he);
+                return DICT_OK;
+            }
+            if (!dictIsRehashing(d)) break;
+            continue;
+        }
         idx = h & d->ht[table].sizemask;
         he = d->ht[table].table[idx];
         prevHe = NULL;
         while(he) {
-            if (dictCompareKeys(d, key, he->key)) {
+            if (dictEntryMatches(d, he, key, h)) {
                 /* Unlink the element from the list */
                 if (prevHe)
-                    prevHe->next = he->next;
+                    _dictStore(prevHe->next, he->next);
                 else
-                    d->ht[table].table[idx] = he->next;
+                    _dictStore(d->ht[table].table[idx], he->next);
                 if (!nofree) {
                     dictFreeKey(d, he);
                     dictFreeVal(d, he);
                 }
-                zfree(he);
+                _dictFreeEntry(d, he);
                 d->ht[table].used--;
                 return DICT_OK;
             }
@@ -452,13 +958,13 @@ int _dictClear(dict *d, dictht *ht, void(callback)(void *)) {
             nextHe = he->next;
             dictFreeKey(d, he);
             dictFreeVal(d, he);
-            zfree(he);
+            _dictFreeEntry(d, he);
             ht->used--;
             he = nextHe;
         }
     }
     /* Free the table and the allocated cache structure */
-    zfree(ht->table);
+    _dictFreeTable(d, ht);
     /* Re-initialize the table */
     _dictReset(ht);
     return DICT_OK; /* never fails */
@@ -473,18 +979,33 @@ void dictRelease(dict *d)
 }
 
 dictEntry *dictFind(dict *d, const void *key)
+{
+    if (d->ht[0].size == 0) return NULL; /* We don't have a table at all */
+    return dictFindWithHash(d, key, dictHashKey(d, key));
+}
+
+/* Like dictFind(), with 'h' the hash of the key as returned by
+ * dictHashKey(). */
+dictEntry *dictFindWithHash(dict *d, const void *key, uint64_t h)
 {
     dictEntry *he;
-    unsigned int h, idx, table;
+    unsigned long idx;
+    int table;
 
     if (d->ht[0].size == 0) return NULL; /* We don't have a table at all */
     if (dictIsRehashing(d)) _dictRehashStep(d);
-    h = dictHashKey(d, key);
     for (table = 0; table <= 1; table++) {
+        if (dictIsOpen(d)) {
+            long slot = _dictOpenLookup(d, &d->ht[table], key, h);
+
+            if (slot != -1) return d->ht[table].table[slot];
+            if (!dictIsRehashing(d)) return NULL;
+            continue;
+        }
         idx = h & d->ht[table].sizemask;
         he = d->ht[table].table[idx];
         while(he) {
-            if (dictCompareKeys(d, key, he->key))
+            if (dictEntryMatches(d, he, key, h))
                 return he;
             he = he->next;
         }
@@ -493,6 +1014,157 @@ dictEntry *dictFind(dict *d, const void *key)
     return NULL;
 }
 
+/* Allow lookups with dictFindConcurrent() while the dict is modified by
+ * another thread. From now on entries and tables are not freed directly
+ * but passed to 'reclaim', that must free them once the concurrent
+ * readers that may be accessing them are gone.
+ *
+ * Writers must still be serialized by the caller, and the dict must not
+ * be released while readers are running. */
+void dictEnableConcurrentReaders(dict *d, dictReclaimFunction *reclaim)
+{
+    d->reclaim = reclaim;
+}
+
+/* Lookup a key in an open addressing table without modifying anything. */
+static dictEntry *_dictOpenFindConcurrent(dict *d, dictEntry **t,
+        const void *key, uint64_t h)
+{
+    const unsigned char *ctrlbase = _dictTableCtrl(t);
+    unsigned long gmask = (_dictTableMask(t)+1)/DICT_GROUP_SIZE-1;
+    unsigned long g = _dictH1(h) & gmask, probes;
+    unsigned char h2 = _dictH2(h);
+
+    for (probes = 0; probes <= gmask; probes++) {
+        const unsigned char *ctrl = ctrlbase+g*DICT_GROUP_SIZE;
+        unsigned int match = _dictGroupMatch(ctrl,h2);
+
+        while(match) {
+            dictEntry *he = _dictLoad(t[g*DICT_GROUP_SIZE+__builtin_ctz(match)]);
+
+            /* The slot may have been cleared after we read its control
+             * byte, or reused for another key. */
+            if (he && dictEntryMatches(d, he, key, h))
+                return he;
+            match &= match-1;
+        }
+        if (_dictGroupMatch(ctrl,DICT_CTRL_EMPTY)) break;
+        g = (g+1) & gmask;
+    }
+    return NULL;
+}
+
+/* Like dictFind(), but safe to call without holding the lock serializing
+ * the writers, see dictEnableConcurrentReaders(). The dict is not modified,
+ * not even to perform a rehashing step.
+ *
+ * The caller is responsible of making sure that the memory passed to the
+ * reclaim function while the lookup runs, and while the returned entry is
+ * in use, is not freed yet. */
+dictEntry *dictFindConcurrent(dict *d, const void *key)
+{
+    return dictFindConcurrentWithHash(d, key, dictHashKey(d, key));
+}
+
+/* Like dictFindConcurrent(), with 'h' the hash of the key. */
+dictEntry *dictFindConcurrentWithHash(dict *d, const void *key, uint64_t h)
+{
+    unsigned long seq;
+    int table;
+
+    do {
+        seq = _dictLoad(d->rehashseq);
+        for (table = 0; table <= 1; table++) {
+            dictEntry **t = _dictLoad(d->ht[table].table);
+            dictEntry *he;
+
+            if (t == NULL) continue;
+            if (dictIsOpen(d)) {
+                he = _dictOpenFindConcurrent(d, t, key, h);
+                if (he) return he;
+                continue;
+            }
+            he = _dictLoad(t[h & _dictTableMask(t)]);
+            while(he) {
+                if (dictEntryMatches(d, he, key, h))
+                    return he;
+                he = _dictLoad(he->next);
+            }
+        }
+        /* A miss is only reliable if no entry was moved meanwhile. */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while((seq & 1) || __atomic_load_n(&d->rehashseq,__ATOMIC_RELAXED) != seq);
+    return NULL;
+}
+
+/* Lookups of many keys stall on a cache miss at every step: the bucket,
+ * the entry, then the key. Looking up a batch of keys, the caller can
+ * instead perform a step for all the keys before the next one, with
+ *
+ *   for every key: dictPrefetch(d, h, DICT_PREFETCH_BUCKET);
+ *   for every key: dictPrefetch(d, h, DICT_PREFETCH_ENTRY);
+ *   for every key: dictPrefetch(d, h, DICT_PREFETCH_KEY);
+ *   for every key: dictFindWithHash(d, key, h);
+ *
+ * where 'h' is the hash of the key. Every step prefetches the memory the
+ * next one accesses, and is already in cache, so the misses of the keys
+ * overlap. Steps of different dicts can be mixed.
+ *
+ * Nothing is modified, so this is safe with concurrent readers as well, like
+ * dictFindConcurrent(). The entries are only tested against the stored
+ * hash: just the keys that will be compared are prefetched. */
+void dictPrefetch(dict *d, uint64_t h, int step)
+{
+    int table;
+
+    for (table = 0; table <= 1; table++) {
+        dictEntry **t = _dictLoad(d->ht[table].table);
+        unsigned long mask;
+        dictEntry *he;
+
+        if (t == NULL) continue;
+        mask = _dictTableMask(t);
+        if (dictIsOpen(d)) {
+            unsigned long g = _dictH1(h) & ((mask+1)/DICT_GROUP_SIZE-1);
+            const unsigned char *ctrl = _dictTableCtrl(t)+g*DICT_GROUP_SIZE;
+            unsigned int match;
+
+            t += g*DICT_GROUP_SIZE;
+            if (step == DICT_PREFETCH_BUCKET) {
+                __builtin_prefetch(ctrl);
+                __builtin_prefetch(t);
+                __builtin_prefetch(t+DICT_GROUP_SIZE/2);
+                continue;
+            }
+            match = _dictGroupMatch(ctrl,_dictH2(h));
+            while(match) {
+                he = _dictLoad(t[__builtin_ctz(match)]);
+                if (he && step == DICT_PREFETCH_ENTRY)
+                    __builtin_prefetch(he);
+                else if (he && he->hash == h)
+                    __builtin_prefetch(he->key);
+                match &= match-1;
+            }
+            continue;
+        }
+        if (step == DICT_PREFETCH_BUCKET) {
+            __builtin_prefetch(t+(h & mask));
+            continue;
+        }
+        he = _dictLoad(t[h & mask]);
+        if (step == DICT_PREFETCH_ENTRY) {
+            if (he) __builtin_prefetch(he);
+            continue;
+        }
+        for (; he; he = _dictLoad(he->next)) {
+            if (he->hash == h) {
+                __builtin_prefetch(he->key);
+                break;
+            }
+        }
+    }
+}
+
 void *dictFetchValue(dict *d, const void *key) {
     dictEntry *he;
 
@@ -580,6 +1252,22 @@ dictEntry *dictNext(dictIterator *iter)
                 }
             }
             iter->entry = ht->table[iter->index];
+            /* Walking a large table is bound by the cache misses on the
+             * entries and on their keys, so like dictPrefetch() does for
+             * lookups the entry some buckets ahead is prefetched, and the
+             * key of the entry half way, that should be in cache by now. */
+            if (iter->index + 2*DICT_ITER_PREFETCH_DISTANCE < (long) ht->size) {
+                dictEntry *ahead =
+                    ht->table[iter->index + 2*DICT_ITER_PREFETCH_DISTANCE];
+
+                if (ahead) __builtin_prefetch(ahead);
+            }
+            if (iter->index + DICT_ITER_PREFETCH_DISTANCE < (long) ht->size) {
+                dictEntry *ahead =
+                    ht->table[iter->index + DICT_ITER_PREFETCH_DISTANCE];
+
+                if (ahead) __builtin_prefetch(ahead->key);
+            }
         } else {
             iter->entry = iter->nextEntry;
         }
@@ -655,6 +1343,41 @@ static unsigned long rev(unsigned long v) {
     return v;
 }
 
+/* Mask of the cursor bits used to address buckets (or groups) of 't'. */
+#define _dictScanMask(d,t) (dictIsOpen(d) ? _dictGroupMask(t) : (t)->sizemask)
+
+/* Emit the entries of the bucket (or home group) 'idx' of table 't'. */
+static void _dictScanBucket(dict *d, dictht *t, unsigned long idx,
+        dictScanFunction *fn, void *privdata)
+{
+    const dictEntry *de;
+
+    if (dictIsOpen(d)) {
+        unsigned long g = idx, gmask = _dictGroupMask(t), probes;
+        int j;
+
+        for (probes = 0; probes <= gmask; probes++) {
+            const unsigned char *ctrl = t->ctrl+g*DICT_GROUP_SIZE;
+
+            for (j = 0; j < DICT_GROUP_SIZE; j++) {
+                if (ctrl[j] & 0x80) continue;
+                de = t->table[g*DICT_GROUP_SIZE+j];
+                if ((_dictH1(de->hash) & gmask) == idx)
+                    fn(privdata, de);
+            }
+            if (_dictGroupMatch(ctrl,DICT_CTRL_EMPTY)) break;
+            g = (g+1) & gmask;
+        }
+        return;
+    }
+
+    de = t->table[idx];
+    while (de) {
+        fn(privdata, de);
+        de = de->next;
+    }
+}
+
 /* dictScan() is used to iterate over the elements of a dictionary.
  *
  * Iterating works the following way:
@@ -724,6 +1447,15 @@ static unsigned long rev(unsigned long v) {
  * table. This reduces the problem back to having only one table, where
  * the larger one, if it exists, is just an expansion of the smaller one.
  *
+ * WHAT ABOUT OPEN ADDRESSING?
+ *
+ * Open addressing tables are scanned one group of slots at a time, so the
+ * cursor indexes groups instead of buckets. Since probing can place a key
+ * in a group that follows its home group, scanning a group means emitting
+ * the keys whose home group is the cursor, following the probe sequence
+ * up to the first group with an empty slot. Keys are then returned in the
+ * same order of the chained engine, with the same guarantees.
+ *
  * LIMITATIONS
  *
  * This iterator is completely stateless, and this is a huge advantage,
@@ -739,27 +1471,23 @@ static unsigned long rev(unsigned long v) {
  * 3) The reverse cursor is somewhat hard to understand at first, but this
  *    comment is supposed to help.
  */
+
 unsigned long dictScan(dict *d,
                        unsigned long v,
                        dictScanFunction *fn,
                        void *privdata)
 {
     dictht *t0, *t1;
-    const dictEntry *de;
     unsigned long m0, m1;
 
     if (dictSize(d) == 0) return 0;
 
     if (!dictIsRehashing(d)) {
         t0 = &(d->ht[0]);
-        m0 = t0->sizemask;
+        m0 = _dictScanMask(d, t0);
 
         /* Emit entries at cursor */
-        de = t0->table[v & m0];
-        while (de) {
-            fn(privdata, de);
-            de = de->next;
-        }
+        _dictScanBucket(d, t0, v & m0, fn, privdata);
 
     } else {
         t0 = &d->ht[0];
@@ -771,25 +1499,17 @@ unsigned long dictScan(dict *d,
             t1 = &d->ht[0];
         }
 
-        m0 = t0->sizemask;
-        m1 = t1->sizemask;
+        m0 = _dictScanMask(d, t0);
+        m1 = _dictScanMask(d, t1);
 
         /* Emit entries at cursor */
-        de = t0->table[v & m0];
-        while (de) {
-            fn(privdata, de);
-            de = de->next;
-        }
+        _dictScanBucket(d, t0, v & m0, fn, privdata);
 
         /* Iterate over indices in larger table that are the expansion
          * of the index pointed to by the cursor in the smaller table */
         do {
             /* Emit entries at cursor */
-            de = t1->table[v & m1];
-            while (de) {
-                fn(privdata, de);
-                de = de->next;
-            }
+            _dictScanBucket(d, t1, v & m1, fn, privdata);
 
             /* Increment bits not covered by the smaller mask */
             v = (((v | m0) + 1) & ~m0) | (v & m0);
@@ -821,6 +1541,15 @@ static int _dictExpandIfNeeded(dict *d)
     /* If the hash table is empty expand it to the initial size. */
     if (d->ht[0].size == 0) return dictExpand(d, DICT_HT_INITIAL_SIZE);
 
+    /* Open addressing tables grow at 7/8 of their slots, tombstones
+     * included, see _dictCapacity(). When most of the used slots are
+     * tombstones this rebuilds a table of the same size. */
+    if (dictIsOpen(d)) {
+        if (d->ht[0].used+d->ht[0].deleted >= _dictCapacity(d, d->ht[0].size))
+            return dictExpand(d, d->ht[0].used*2);
+        return DICT_OK;
+    }
+
     /* If we reached the 1:1 ratio, and we are allowed to resize the hash
      * table (global setting) or we should avoid it but the ratio between
      * elements/buckets is over the "safe" threshold, we resize doubling
@@ -848,27 +1577,30 @@ static unsigned long _dictNextPower(unsigned long size)
 }
 
 /* Returns the index of a free slot that can be populated with
- * a hash entry for the given 'key'.
- * If the key already exists, -1 is returned.
+ * a hash entry for the given 'key', and stores the hash of the key
+ * in '*hash'. If the key already exists, -1 is returned.
  *
  * Note that if we are in the process of rehashing the hash table, the
  * index is always returned in the context of the second (new) hash table. */
-static int _dictKeyIndex(dict *d, const void *key)
+static long _dictKeyIndex(dict *d, const void *key, uint64_t *hash)
 {
-    unsigned int h, idx, table;
+    uint64_t h;
+    unsigned long idx = 0;
     dictEntry *he;
+    int table;
 
     /* Expand the hash table if needed */
     if (_dictExpandIfNeeded(d) == DICT_ERR)
         return -1;
     /* Compute the key hash value */
     h = dictHashKey(d, key);
+    *hash = h;
     for (table = 0; table <= 1; table++) {
         idx = h & d->ht[table].sizemask;
         /* Search if this slot does not already contain the given key */
         he = d->ht[table].table[idx];
         while(he) {
-            if (dictCompareKeys(d, key, he->key))
+            if (dictEntryMatches(d, he, key, h))
                 return -1;
             he = he->next;
         }
@@ -954,7 +1686,7 @@ void dictPrintStats(dict *d) {
 
 /* ----------------------- StringCopy Hash Table Type ------------------------*/
 
-static unsigned int _dictStringCopyHTHashFunction(const void *key)
+static uint64_t _dictStringCopyHTHashFunction(const void *key)
 {
     return dictGenHashFunction(key, strlen(key));
 }
@@ -991,7 +1723,8 @@ dictType dictTypeHeapStringCopyKey = {
     NULL,                          /* val dup */
     _dictStringCopyHTKeyCompare,   /* key compare */
     _dictStringDestructor,         /* key destructor */
-    NULL                           /* val destructor */
+    NULL,                          /* val destructor */
+    NULL                           /* entry free */
 };
 
 /* This is like StringCopy but does not auto-duplicate the key.
@@ -1002,7 +1735,8 @@ dictType dictTypeHeapStrings = {
     NULL,                          /* val dup */
     _dictStringCopyHTKeyCompare,   /* key compare */
     _dictStringDestructor,         /* key destructor */
-    NULL                           /* val destructor */
+    NULL,                          /* val destructor */
+    NULL                           /* entry free */
 };
 
 /* This is like StringCopy but also automatically handle dynamic
@@ -1014,5 +1748,198 @@ dictType dictTypeHeapStringCopyKeyValue = {
     _dictStringCopyHTKeyCompare,   /* key compare */
     _dictStringDestructor,         /* key destructor */
     _dictStringDestructor,         /* val destructor */
+    NULL                           /* entry free */
 };
 #endif
+
+/* ------------------------------- Benchmark ---------------------------------*/
+
+#ifdef DICT_BENCHMARK_MAIN
+
+#include "sds.h"
+
+uint64_t hashCallback(const void *key) {
+    return dictGenHashFunction((unsigned char*)key, sdslen((char*)key));
+}
+
+int compareCallback(void *privdata, const void *key1, const void *key2) {
+    int l1,l2;
+    DICT_NOTUSED(privdata);
+
+    l1 = sdslen((sds)key1);
+    l2 = sdslen((sds)key2);
+    if (l1 != l2) return 0;
+    return memcmp(key1, key2, l1) == 0;
+}
+
+void freeCallback(void *privdata, void *val) {
+    DICT_NOTUSED(privdata);
+
+    sdsfree(val);
+}
+
+dictType BenchmarkDictType = {
+    hashCallback,
+    NULL,
+    NULL,
+    compareCallback,
+    freeCallback,
+    NULL,
+    NULL
+};
+
+#define start_benchmark() start = timeInMilliseconds()
+#define end_benchmark(msg) do { \
+    elapsed = timeInMilliseconds()-start; \
+    printf(msg ": %ld items in %lld ms (%.0f ops/sec)\n", count, elapsed, \
+        elapsed ? (double)count*1000/elapsed : 0); \
+} while(0)
+
+/* Lookups are performed in random order with keys created in advance, so
+ * that what we measure is the cost of the table and not of sdsnew(). */
+static void benchmarkEngine(char *name, int engine, sds *hits, sds *misses,
+        long count)
+{
+    dict *dict = dictCreateWithEngine(&BenchmarkDictType,NULL,engine);
+    long long start, elapsed;
+    long j, found;
+
+    printf("== %s engine\n", name);
+    start_benchmark();
+    for (j = 0; j < count; j++) {
+        int retval = dictAdd(dict,sdsfromlonglong(j),NULL);
+        assert(retval == DICT_OK);
+    }
+    end_benchmark("Inserting");
+    assert((long)dictSize(dict) == count);
+
+    /* Wait for rehashing. */
+    while (dictIsRehashing(dict)) {
+        dictRehashMilliseconds(dict,100);
+    }
+
+    start_benchmark();
+    for (found = 0, j = 0; j < count; j++)
+        found += dictFind(dict,hits[j]) != NULL;
+    end_benchmark("Random access of existing elements");
+    assert(found == count);
+
+    start_benchmark();
+    for (found = 0, j = 0; j < count; j++)
+        found += dictFind(dict,misses[j]) != NULL;
+    end_benchmark("Accessing missing");
+    assert(found == 0);
+
+    start_benchmark();
+    for (j = 0; j < count; j++) {
+        int retval = dictDelete(dict,hits[j]);
+        assert(retval == DICT_OK);
+    }
+    end_benchmark("Removing");
+    dictRelease(dict);
+}
+
+/* Time to move all the entries of a table with 'count' keys to a table of
+ * twice the size, as the incremental rehashing does. */
+static void benchmarkRehash(char *name, int engine, long count) {
+    dict *dict = dictCreateWithEngine(&BenchmarkDictType,NULL,engine);
+    long long start, elapsed;
+    long j;
+
+    for (j = 0; j < count; j++)
+        dictAdd(dict,sdsfromlonglong(j),NULL);
+    while (dictIsRehashing(dict)) dictRehashMilliseconds(dict,100);
+    dictExpand(dict,dictSlots(dict)*2);
+    start_benchmark();
+    while (dictIsRehashing(dict)) dictRehashMilliseconds(dict,100);
+    elapsed = timeInMilliseconds()-start;
+    printf("Rehashing %s: %ld items in %lld ms\n", name, count, elapsed);
+    dictRelease(dict);
+}
+
+/* Expand an open addressing table to just the number of keys it has, then
+ * keep adding keys: the new table fills up before the old one is drained,
+ * and must grow rather than run out of free slots. */
+static void checkOpenGrowth(long count) {
+    dict *dict = dictCreateWithEngine(&BenchmarkDictType,NULL,
+                                      DICT_ENGINE_OPEN);
+    long j;
+
+    for (j = 0; j < 1000; j++)
+        dictAdd(dict,sdsfromlonglong(j),NULL);
+    while (dictIsRehashing(dict)) dictRehashMilliseconds(dict,100);
+    assert(dictExpand(dict,dictSize(dict)) == DICT_OK);
+    for (j = 1000; j < count; j++) {
+        int retval = dictAdd(dict,sdsfromlonglong(j),NULL);
+        assert(retval == DICT_OK);
+    }
+    assert((long)dictSize(dict) == count);
+    for (j = 0; j < count; j++) {
+        sds key = sdsfromlonglong(j);
+
+        assert(dictFind(dict,key) != NULL);
+        sdsfree(key);
+    }
+    printf("Open addressing growth while rehashing: %ld items ok\n", count);
+    dictRelease(dict);
+}
+
+/* Hash throughput for keys of a few lengths. The keys start at different
+ * offsets of the buffer so that the calls can't be hoisted. */
+static void benchmarkHash(void) {
+    static const int lens[] = {8, 16, 24, 32, 64, 128, 1024};
+    unsigned char buf[1024+8];
+    uint64_t acc = 0;
+    unsigned int k;
+
+    for (k = 0; k < sizeof(buf); k++) buf[k] = random();
+    for (k = 0; k < sizeof(lens)/sizeof(lens[0]); k++) {
+        long count = 400000000/(lens[k]+32), j;
+        long long start, elapsed;
+
+        start = timeInMilliseconds();
+        for (j = 0; j < count; j++)
+            acc += dictGenHashFunction(buf+(j&7),lens[k]);
+        elapsed = timeInMilliseconds()-start;
+        if (elapsed == 0) elapsed = 1;
+        printf("Hashing %d byte keys: %.2f ns per key, %.2f GB/s\n", lens[k],
+            (double)elapsed*1000000/count,
+            (double)count*lens[k]/elapsed/1000000);
+    }
+    if (acc == 0) printf("\n");
+}
+
+/* dict-benchmark [count] */
+int main(int argc, char **argv) {
+    long j, count;
+    sds *hits, *misses;
+
+    if (argc == 2) {
+        count = strtol(argv[1],NULL,10);
+    } else {
+        count = 5000000;
+    }
+
+    hits = zmalloc(sizeof(sds)*count);
+    misses = zmalloc(sizeof(sds)*count);
+    for (j = 0; j < count; j++) {
+        hits[j] = sdsfromlonglong(j);
+        misses[j] = sdscatprintf(sdsempty(),"missing:%ld",j);
+    }
+    for (j = count-1; j > 0; j--) {
+        long k = random() % (j+1);
+        sds tmp = hits[j];
+
+        hits[j] = hits[k];
+        hits[k] = tmp;
+    }
+
+    checkOpenGrowth(100000);
+    benchmarkHash();
+    benchmarkEngine("chained",DICT_ENGINE_CHAINED,hits,misses,count);
+    benchmarkEngine("open addressing",DICT_ENGINE_OPEN,hits,misses,count);
+    benchmarkRehash("chained",DICT_ENGINE_CHAINED,count*2);
+    benchmarkRehash("open addressing",DICT_ENGINE_OPEN,count*2);
+    return 0;
+}
+#endif
@@ -53,32 +53,54 @@ typedef struct dictEntry {
         double d;
     } v;
     struct dictEntry *next;
+    uint64_t hash; /* Hash of the key, set when the entry is added */
 } dictEntry;
 
 typedef struct dictType {
-    unsigned int (*hashFunction)(const void *key);
+    uint64_t (*hashFunction)(const void *key);
     void *(*keyDup)(void *privdata, const void *key);
     void *(*valDup)(void *privdata, const void *obj);
     int (*keyCompare)(void *privdata, const void *key1, const void *key2);
     void (*keyDestructor)(void *privdata, void *key);
     void (*valDestructor)(void *privdata, void *obj);
+    /* Frees the entries, zfree() if NULL: entries added with dictAddEntry()
+     * may be allocated by other means. */
+    void (*entryFree)(void *ptr);
 } dictType;
 
 /* This is our hash table structure. Every dictionary has two of this as we
- * implement incremental rehashing, for the old to the new table. */
+ * implement incremental rehashing, for the old to the new table.
+ *
+ * Open addressing tables (DICT_ENGINE_OPEN) use 'table' as an array of
+ * slots holding at most one entry each, plus one control byte per slot
+ * in 'ctrl' that is either empty, deleted, or the low 7 bits of the hash
+ * of the key stored in the slot.
+ *
+ * The table is allocated together with a copy of its sizemask and, for
+ * open addressing, the control bytes, so that concurrent readers can get
+ * a consistent view of a table just loading the 'table' pointer. */
 typedef struct dictht {
     dictEntry **table;
+    unsigned char *ctrl;
     unsigned long size;
     unsigned long sizemask;
     unsigned long used;
+    unsigned long deleted; /* tombstones, open addressing only */
 } dictht;
 
+/* Function used to release memory that concurrent readers may still be
+ * accessing: 'freefn' must be called on 'ptr' once they are gone. */
+typedef void (dictReclaimFunction)(void *ptr, void (*freefn)(void *ptr));
+
 typedef struct dict {
     dictType *type;
     void *privdata;
     dictht ht[2];
     long rehashidx; /* rehashing not in progress if rehashidx == -1 */
     int iterators; /* number of iterators currently running */
+    int engine; /* DICT_ENGINE_CHAINED or DICT_ENGINE_OPEN */
+    dictReclaimFunction *reclaim; /* NULL if there are no concurrent readers */
+    unsigned long rehashseq; /* odd while entries are moved between tables */
 } dict;
 
 /* If safe is set to 1 this is a safe iterator, that means, you can call
@@ -99,6 +121,25 @@ typedef void (dictScanFunction)(void *privdata, const dictEntry *de);
 /* This is the initial size of every hash table */
 #define DICT_HT_INITIAL_SIZE     4
 
+/* Table engines. The chained engine is the classic array of buckets with
+ * linked entries. The open addressing engine stores entries directly in
+ * the slots and probes groups of DICT_GROUP_SIZE control bytes at a time
+ * (with SSE2 when available), so a lookup only dereferences entries whose
+ * 7 bit hash fingerprint matches. */
+#define DICT_ENGINE_CHAINED 0
+#define DICT_ENGINE_OPEN 1
+
+#define DICT_GROUP_SIZE 16
+#define DICT_OPEN_INITIAL_SIZE DICT_GROUP_SIZE
+
+/* Steps of a batched lookup, see dictPrefetch() */
+#define DICT_PREFETCH_BUCKET 0
+#define DICT_PREFETCH_ENTRY 1
+#define DICT_PREFETCH_KEY 2
+
+/* Buckets ahead of dictNext() whose keys are prefetched */
+#define DICT_ITER_PREFETCH_DISTANCE 8
+
 /* ------------------------------- Macros ------------------------------------*/
 #define dictFreeVal(d, entry) \
     if ((d)->type->valDestructor) \
@@ -137,6 +178,11 @@ typedef void (dictScanFunction)(void *privdata, const dictEntry *de);
         (key1) == (key2))
 
 #define dictHashKey(d, key) (d)->type->hashFunction(key)
+
+/* The stored hash is compared first: most entries not matching the key are
+ * skipped without touching the key. */
+#define dictEntryMatches(d, he, key, h) \
+    ((he)->hash == (h) && dictCompareKeys(d, key, (he)->key))
 #define dictGetKey(he) ((he)->key)
 #define dictGetVal(he) ((he)->v.val)
 #define dictGetSignedIntegerVal(he) ((he)->v.s64)
@@ -145,18 +191,29 @@ typedef void (dictScanFunction)(void *privdata, const dictEntry *de);
 #define dictSlots(d) ((d)->ht[0].size+(d)->ht[1].size)
 #define dictSize(d) ((d)->ht[0].used+(d)->ht[1].used)
 #define dictIsRehashing(d) ((d)->rehashidx != -1)
+#define dictIsOpen(d) ((d)->engine == DICT_ENGINE_OPEN)
 
 /* API */
 dict *dictCreate(dictType *type, void *privDataPtr);
+dict *dictCreateWithEngine(dictType *type, void *privDataPtr, int engine);
 int dictExpand(dict *d, unsigned long size);
+int dictReserve(dict *d, unsigned long n);
 int dictAdd(dict *d, void *key, void *val);
 dictEntry *dictAddRaw(dict *d, void *key);
+int dictAddEntry(dict *d, dictEntry *entry);
+int dictAddNewEntry(dict *d, dictEntry *entry, uint64_t h);
+int dictReplaceEntry(dict *d, dictEntry *oldde, dictEntry *newde);
 int dictReplace(dict *d, void *key, void *val);
 dictEntry *dictReplaceRaw(dict *d, void *key);
 int dictDelete(dict *d, const void *key);
 int dictDeleteNoFree(dict *d, const void *key);
 void dictRelease(dict *d);
 dictEntry * dictFind(dict *d, const void *key);
+dictEntry *dictFindWithHash(dict *d, const void *key, uint64_t h);
+void dictEnableConcurrentReaders(dict *d, dictReclaimFunction *reclaim);
+dictEntry *dictFindConcurrent(dict *d, const void *key);
+dictEntry *dictFindConcurrentWithHash(dict *d, const void *key, uint64_t h);
+void dictPrefetch(dict *d, uint64_t h, int step);
 void *dictFetchValue(dict *d, const void *key);
 int dictResize(dict *d);
 dictIterator *dictGetIterator(dict *d);
@@ -165,15 +222,16 @@ dictEntry *dictNext(dictIterator *iter);
 void dictReleaseIterator(dictIterator *iter);
 dictEntry *dictGetRandomKey(dict *d);
 void dictPrintStats(dict *d);
-unsigned int dictGenHashFunction(const void *key, int len);
-unsigned int dictGenCaseHashFunction(const unsigned char *buf, int len);
+uint64_t dictGenHashFunction(const void *key, int len);
+uint64_t dictGenCaseHashFunction(const unsigned char *buf, int len);
 void dictEmpty(dict *d, void(callback)(void*));
 void dictEnableResize(void);
 void dictDisableResize(void);
 int dictRehash(dict *d, int n);
 int dictRehashMilliseconds(dict *d, int ms);
-void dictSetHashFunctionSeed(unsigned int initval);
-unsigned int dictGetHashFunctionSeed(void);
+int dictRehashMicroseconds(dict *d, long long us);
+void dictSetHashFunctionSeed(uint64_t seed);
+uint64_t dictGetHashFunctionSeed(void);
 unsigned long dictScan(dict *d, unsigned long v, dictScanFunction *fn, void *privdata);
 
 /* Hash table types */
@@ -0,0 +1,259 @@
+/* Epoch based memory reclamation, see epoch.h.
+ *
+ * Every thread using epochs has a record in a global list. Records are never
+ * removed, so the list can be walked without locks: when a thread exits its
+ * record is left outside any section and reused by the next thread that
+ * needs one. The state of a record
+ * is zero when the thread is outside a read section, otherwise it is the
+ * global epoch observed when the section was entered, shifted left by one
+ * and with the low bit set.
+ *
+ * The global epoch is advanced from E to E+1 only when all the threads
+ * inside a read section observed E. So once the epoch is E+2 no thread can
+ * be in a section entered at epoch E or before, and the objects retired
+ * during epoch E, that were already unlinked from the shared structures,
+ * can be freed.
+ *
+ * Retired objects are queued in the record of the retiring thread, that
+ * frees them itself in later calls, so retiring needs no synchronization.
+ * The objects still queued when a thread exits are moved to a global list
+ * of orphans, freed by the next threads collecting.
+ *
+ * Pins are not in a record: they are just counted, by the parity of the
+ * epoch observed when taken. Like a section, a pin taken at epoch E stops
+ * the global epoch from going past E+1, so pins only exist for the current
+ * epoch and the previous one, and the two counters tell them apart. A pin
+ * counted as current while it observed an older epoch (the epoch advanced
+ * twice before the counter was incremented) is safe as well: it protects
+ * the objects reached after the increment, that were not retired yet. */
+
+#include "fmacros.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "epoch.h"
+#include "zmalloc.h"
+
+/* Try to free the retired objects every EPOCH_COLLECT_INTERVAL retires. */
+#define EPOCH_COLLECT_INTERVAL 64
+
+typedef struct epochRetired {
+	void *ptr;
+	epochFreeFunction *freefn;
+	uint64_t epoch; /* Global epoch when the object was retired */
+	int arena; /* zmalloc arena of the retiring thread, freed to it */
+} epochRetired;
+
+typedef struct epochRecord {
+	uint64_t state;
+	struct epochRecord *next;
+	int used; /* Owned by a running thread */
+	epochRetired *retired; /* Objects retired by this thread, oldest first */
+	long count, size;
+	long retires; /* Objects retired since the thread started */
+	/* Keep the state of different threads in different cache lines. */
+	char pad[64];
+} epochRecord;
+
+static uint64_t global_epoch = 1;
+static long pins[2]; /* Pins taken at even and odd epochs */
+static epochRecord *records = NULL;
+static __thread epochRecord *self = NULL;
+static pthread_once_t self_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t self_key; /* Runs epochThreadExit() for the record */
+
+/* Objects retired by threads that exited, in no particular order */
+static pthread_mutex_t orphans_lock = PTHREAD_MUTEX_INITIALIZER;
+static epochRetired *orphans = NULL;
+static long orphans_count = 0, orphans_size = 0;
+
+/* Called when a thread with a record exits: leave its section, so that it
+ * doesn't stop the global epoch forever, pass the objects it didn't free yet
+ * to the orphans, and make the record available to new threads. */
+static void epochThreadExit(void *arg) {
+	epochRecord *r = arg;
+
+	__atomic_store_n(&r->state, 0, __ATOMIC_RELEASE);
+	if (r->count) {
+		pthread_mutex_lock(&orphans_lock);
+		if (orphans_count + r->count > orphans_size) {
+			orphans_size = orphans_count + r->count;
+			orphans = zrealloc(orphans, sizeof(epochRetired) * orphans_size);
+		}
+		memcpy(orphans + orphans_count, r->retired,
+				sizeof(epochRetired) * r->count);
+		__atomic_store_n(&orphans_count, orphans_count + r->count,
+				__ATOMIC_RELAXED);
+		pthread_mutex_unlock(&orphans_lock);
+		r->count = 0;
+	}
+	self = NULL;
+	__atomic_store_n(&r->used, 0, __ATOMIC_RELEASE);
+}
+
+static void epochCreateKey(void) {
+	pthread_key_create(&self_key, epochThreadExit);
+}
+
+/* Return the record of the calling thread, taking one the first time: the
+ * record of a thread that exited if any, otherwise a new one. */
+static epochRecord *epochSelf(void) {
+	epochRecord *r = self;
+	int unused;
+
+	if (r == NULL) {
+		for (r = __atomic_load_n(&records, __ATOMIC_ACQUIRE); r; r = r->next) {
+			unused = 0;
+			if (__atomic_load_n(&r->used, __ATOMIC_RELAXED) == 0 &&
+					__atomic_compare_exchange_n(&r->used, &unused, 1, 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				break;
+		}
+		if (r == NULL) {
+			r = zcalloc(sizeof(*r));
+			r->used = 1;
+			r->next = __atomic_load_n(&records, __ATOMIC_RELAXED);
+			while (!__atomic_compare_exchange_n(&records, &r->next, r, 1,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+				;
+		}
+		pthread_once(&self_key_once, epochCreateKey);
+		pthread_setspecific(self_key, r);
+		self = r;
+	}
+	return r;
+}
+
+/* Free the first objects of 'retired' that can't be accessed by any reader
+ * at 'epoch', stopping at the first one that still can. Returns the number
+ * of objects left, moved to the start of the array. */
+static long epochFreeRetired(epochRetired *retired, long count,
+		uint64_t epoch) {
+	int arena = zmalloc_get_thread_arena();
+	long freed;
+
+	for (freed = 0; freed < count; freed++) {
+		epochRetired *o = &retired[freed];
+
+		if (o->epoch + 2 > epoch)
+			break;
+		zmalloc_set_thread_arena(o->arena);
+		o->freefn(o->ptr);
+	}
+	if (freed) {
+		zmalloc_set_thread_arena(arena);
+		memmove(retired, retired + freed,
+				sizeof(epochRetired) * (count - freed));
+	}
+	return count - freed;
+}
+
+/* Enter a read section. Calling it again while already inside a section
+ * marks a quiescent point: the objects accessed before the call are no
+ * longer protected. */
+void epochEnter(void) {
+	epochRecord *r = epochSelf();
+	uint64_t state = (__atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE) << 1) | 1;
+
+	/* The state must be visible to the other threads before we start
+	 * reading the shared structures, hence the full barrier. */
+	if (r->state != state)
+		__atomic_store_n(&r->state, state, __ATOMIC_SEQ_CST);
+}
+
+/* Leave the read section, if any. */
+void epochExit(void) {
+	epochRecord *r = self;
+
+	if (r != NULL && r->state != 0)
+		__atomic_store_n(&r->state, 0, __ATOMIC_RELEASE);
+}
+
+/* Free 'ptr' calling 'freefn' once no read section that may be accessing it
+ * is running. The object must already be unreachable for new readers. */
+void epochRetire(void *ptr, epochFreeFunction *freefn) {
+	epochRecord *r = epochSelf();
+
+	if (r->count == r->size) {
+		int arena = zmalloc_get_thread_arena();
+
+		/* The queue belongs to no arena the thread may be working on */
+		zmalloc_set_thread_arena(ZMALLOC_NO_ARENA);
+		r->size = r->size ? r->size * 2 : EPOCH_COLLECT_INTERVAL;
+		r->retired = zrealloc(r->retired, sizeof(epochRetired) * r->size);
+		zmalloc_set_thread_arena(arena);
+	}
+	r->retired[r->count].ptr = ptr;
+	r->retired[r->count].freefn = freefn;
+	r->retired[r->count].epoch = __atomic_load_n(&global_epoch,
+			__ATOMIC_ACQUIRE);
+	r->retired[r->count].arena = zmalloc_get_thread_arena();
+	r->count++;
+	if (++r->retires % EPOCH_COLLECT_INTERVAL == 0)
+		epochCollect();
+}
+
+/* Try to advance the global epoch, then free the objects retired by the
+ * calling thread, and the orphans, that can't be accessed by any reader
+ * anymore. */
+void epochCollect(void) {
+	epochRecord *r = epochSelf(), *t;
+	uint64_t epoch;
+
+	/* Objects were unlinked before being retired: make sure the stores are
+	 * visible before checking which readers may still see them. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+	for (t = __atomic_load_n(&records, __ATOMIC_ACQUIRE); t; t = t->next) {
+		uint64_t state = __atomic_load_n(&t->state, __ATOMIC_ACQUIRE);
+
+		if ((state & 1) && (state >> 1) != epoch)
+			break;
+	}
+	if (t == NULL && __atomic_load_n(&pins[(epoch + 1) & 1],
+			__ATOMIC_ACQUIRE) == 0) {
+		/* On failure another thread advanced it, that is just as good. */
+		__atomic_compare_exchange_n(&global_epoch, &epoch, epoch + 1, 0,
+				__ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+		epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+	}
+
+	r->count = epochFreeRetired(r->retired, r->count, epoch);
+
+	/* The orphans are not sorted by epoch: some may wait for a few more
+	 * calls than needed. A thread already freeing them is enough. */
+	if (__atomic_load_n(&orphans_count, __ATOMIC_RELAXED) &&
+			pthread_mutex_trylock(&orphans_lock) == 0) {
+		__atomic_store_n(&orphans_count,
+				epochFreeRetired(orphans, orphans_count, epoch),
+				__ATOMIC_RELAXED);
+		pthread_mutex_unlock(&orphans_lock);
+	}
+}
+
+/* Return true if the calling thread has retired objects not freed yet. */
+int epochPending(void) {
+	return self != NULL && self->count != 0;
+}
+
+/* Take a pin, returning the value to pass to epochUnpin(), never zero. */
+uint64_t epochPin(void) {
+	uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+
+	/* Like the state of a section, the pin must be visible before the
+	 * shared structures are read. */
+	__atomic_fetch_add(&pins[epoch & 1], 1, __ATOMIC_SEQ_CST);
+	return epoch;
+}
+
+void epochUnpin(uint64_t pin) {
+	__atomic_fetch_sub(&pins[pin & 1], 1, __ATOMIC_RELEASE);
+}
+
+/* Return true if any pin is held. */
+int epochPinned(void) {
+	return __atomic_load_n(&pins[0], __ATOMIC_ACQUIRE) != 0
+			|| __atomic_load_n(&pins[1], __ATOMIC_ACQUIRE) != 0;
+}
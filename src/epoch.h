@@ -0,0 +1,34 @@
+/* Epoch based memory reclamation.
+ *
+ * Readers accessing shared structures without locks do it between
+ * epochEnter() and epochExit(). Writers unlink objects from the structures
+ * and then pass them to epochRetire(): an object is actually freed only
+ * when all the read sections that could be accessing it are over.
+ *
+ * A thread that stays inside a read section forever prevents any object
+ * from being freed, so threads going idle should call epochExit(). Threads
+ * exiting leave their section automatically, and the objects they retired
+ * are freed by the other threads.
+ *
+ * A pin, taken with epochPin(), protects the objects accessed after taking
+ * it like a read section, but it is not bound to the thread: it can be held
+ * across calls, and released by any thread with epochUnpin(). Pins are
+ * meant to be short lived as well. */
+
+#ifndef __EPOCH_H
+#define __EPOCH_H
+
+#include <stdint.h>
+
+typedef void (epochFreeFunction)(void *ptr);
+
+void epochEnter(void);
+void epochExit(void);
+void epochRetire(void *ptr, epochFreeFunction *freefn);
+void epochCollect(void);
+int epochPending(void);
+uint64_t epochPin(void);
+void epochUnpin(uint64_t pin);
+int epochPinned(void);
+
+#endif /* __EPOCH_H */
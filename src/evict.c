@@ -0,0 +1,522 @@
+/* Eviction of keys when the memory limit is reached.
+ *
+ * Like Redis we don't keep the keys ordered by access time, that would cost
+ * memory for every key and work for every lookup. The access time is just
+ * stored in the value (see LRU_CLOCK()) and, when keys must be evicted, a
+ * few keys are sampled and the best candidates are remembered in the
+ * eviction pool of the DB, sorted by idle time. The key with the greatest
+ * idle time in the pool is evicted.
+ *
+ * Keeping the pool across calls makes the approximation much better than
+ * just evicting the best of every sample, for the same number of samples.
+ *
+ * The LFU policies use the same pool, ranking keys by an approximated
+ * access frequency instead, see the LFU section below. */
+
+#include "fmacros.h"
+#include "db.h"
+
+/* Policy and LFU tuning, set by mdbSetMaxmemory() and mdbSetLfuParams().
+ * The values of the keys are interpreted according to the policy, so it
+ * should be set before the keys are created. */
+int maxmemory_policy = MAXMEMORY_NO_EVICTION;
+int lfu_log_factor = LFU_LOG_FACTOR;
+int lfu_decay_time = LFU_DECAY_TIME;
+
+struct evictionPoolEntry {
+	unsigned long long idle; /* Object idle time, or inverse TTL */
+	sds key; /* Key name, a copy since the item may be freed at any time */
+};
+
+/*-----------------------------------------------------------------------------
+ * LFU
+ *
+ * The lru field of values is split in two parts:
+ *
+ *           16 bits      8 bits
+ *      +----------------+--------+
+ *      + Last decr time | LOG_C  |
+ *      +----------------+--------+
+ *
+ * LOG_C is a logarithmic counter of the accesses: the more it is high, the
+ * less likely an access increments it, so 8 bits are enough for millions
+ * of accesses. It is decremented by one every lfu_decay_time minutes the
+ * key was not accessed, so keys that were popular in the past don't stay
+ * in memory forever. The decrement is computed lazily when the key is
+ * accessed or sampled for eviction, using the time of the last one.
+ *----------------------------------------------------------------------------*/
+
+/* Return the current time in minutes, just taking the least significant
+ * 16 bits. */
+static unsigned long LFUGetTimeInMinutes(void) {
+	return (cachedMstime() / 1000 / 60) & 65535;
+}
+
+/* Minutes elapsed since 'ldt', taking into account the wrap of the clock. */
+static unsigned long LFUTimeElapsed(unsigned long ldt) {
+	unsigned long now = LFUGetTimeInMinutes();
+
+	if (now >= ldt)
+		return now - ldt;
+	return 65535 - ldt + now;
+}
+
+/* Cheap per thread random numbers: rand() takes a lock in glibc, and lock-free
+ * readers update the counters too. */
+static double LFURandom(void) {
+	static __thread uint32_t seed = 0;
+
+	if (seed == 0)
+		seed = (uint32_t) (uintptr_t) &seed | 1;
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return (double) seed / UINT32_MAX;
+}
+
+/* Logarithmically increment a counter: the greater is the current counter
+ * value, the less likely is that it gets really incremented. */
+static unsigned long LFULogIncr(unsigned long counter) {
+	double baseval, p;
+
+	if (counter == 255)
+		return 255;
+	baseval = (double) counter - LFU_INIT_VAL;
+	if (baseval < 0)
+		baseval = 0;
+	p = 1.0 / (baseval * lfu_log_factor + 1);
+	if (LFURandom() < p)
+		counter++;
+	return counter;
+}
+
+/* Return the counter stored in 'lru', decremented by the number of decay
+ * periods elapsed since the last decrement. */
+static unsigned long LFUDecr(unsigned lru) {
+	unsigned long ldt = lru >> 8;
+	unsigned long counter = lru & 255;
+	unsigned long periods = lfu_decay_time ?
+			LFUTimeElapsed(ldt) / lfu_decay_time : 0;
+
+	if (periods)
+		counter = (periods > counter) ? 0 : counter - periods;
+	return counter;
+}
+
+unsigned long valueLFUCounter(value_t *val) {
+	return LFUDecr(__atomic_load_n(&val->lru, __ATOMIC_RELAXED));
+}
+
+/* Initial value of the lru field of new values. */
+unsigned valueAccessInit(void) {
+	if (maxmemory_policy & MAXMEMORY_FLAG_LFU)
+		return (LFUGetTimeInMinutes() << 8) | LFU_INIT_VAL;
+	return LRU_CLOCK();
+}
+
+/* Update the access data of a value when it is accessed. Lock-free readers
+ * call it as well, so the field is accessed atomically, and it is only
+ * written when it changes to avoid dirtying the cache line. Concurrent
+ * increments of an LFU counter may be lost, that is fine for an
+ * approximation. */
+void valueTouch(value_t *val) {
+	unsigned old = __atomic_load_n(&val->lru, __ATOMIC_RELAXED), lru;
+
+	if (maxmemory_policy & MAXMEMORY_FLAG_LFU)
+		lru = (LFUGetTimeInMinutes() << 8) | LFULogIncr(LFUDecr(old));
+	else
+		lru = LRU_CLOCK();
+	if (lru != old)
+		__atomic_store_n(&val->lru, lru, __ATOMIC_RELAXED);
+}
+
+/*-----------------------------------------------------------------------------
+ * TinyLFU admission
+ *
+ * Under memory pressure every new key evicts an old one, even if the new
+ * key will never be accessed again: a scan of one-off keys flushes the hot
+ * keys out. The admission filter estimates the access frequency of all the
+ * keys, evicted and never stored ones included, with a count-min sketch,
+ * and a new key is stored only if it is not less popular than the key it
+ * would evict.
+ *
+ * The sketch has FREQ_SKETCH_DEPTH rows of 8 bit counters. A key increments
+ * one counter per row, and its frequency is the minimum of its counters.
+ * Only the counters equal to the minimum are incremented (conservative
+ * update), which reduces the overestimation due to collisions. To forget
+ * the past, all the counters are halved every width*FREQ_SKETCH_SAMPLE_FACTOR
+ * increments.
+ *----------------------------------------------------------------------------*/
+
+frequencySketch *sketchNew(unsigned long width) {
+	frequencySketch *s = zmalloc(sizeof(*s));
+	unsigned long w = FREQ_SKETCH_MIN_WIDTH;
+
+	while (w < width)
+		w <<= 1;
+	s->table = zcalloc(FREQ_SKETCH_DEPTH * w);
+	s->width = w;
+	s->additions = 0;
+	s->sample_size = w * FREQ_SKETCH_SAMPLE_FACTOR;
+	return s;
+}
+
+void sketchFree(frequencySketch *s) {
+	if (s == NULL)
+		return;
+	zfree(s->table);
+	zfree(s);
+}
+
+/* Fill 'idx' with the counter of every row for the key hash. The hash is
+ * mixed again, since its low and high bits also select the bucket and the
+ * slot of the key, and split in two halves combined to address the rows. */
+static void sketchIndexes(frequencySketch *s, uint64_t hash,
+		unsigned long *idx) {
+	uint64_t z = hash + 0x9e3779b97f4a7c15ULL;
+	uint32_t h1, h2;
+	int i;
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	z ^= z >> 31;
+	h1 = (uint32_t) z;
+	h2 = (uint32_t) (z >> 32) | 1;
+	for (i = 0; i < FREQ_SKETCH_DEPTH; i++)
+		idx[i] = i * s->width + ((h1 + i * h2) & (s->width - 1));
+}
+
+/* Halve all the counters. Increments done meanwhile by other threads may be
+ * lost. */
+static void sketchReset(frequencySketch *s) {
+	unsigned long j;
+
+	for (j = 0; j < FREQ_SKETCH_DEPTH * s->width; j++) {
+		unsigned char c = __atomic_load_n(&s->table[j], __ATOMIC_RELAXED);
+
+		if (c)
+			__atomic_store_n(&s->table[j], c >> 1, __ATOMIC_RELAXED);
+	}
+}
+
+/* Record an access to the key with the specified hash. */
+void sketchIncrement(frequencySketch *s, uint64_t hash) {
+	unsigned long idx[FREQ_SKETCH_DEPTH];
+	unsigned char min = 255;
+	int i;
+
+	sketchIndexes(s, hash, idx);
+	for (i = 0; i < FREQ_SKETCH_DEPTH; i++) {
+		unsigned char c = __atomic_load_n(&s->table[idx[i]], __ATOMIC_RELAXED);
+
+		if (c < min)
+			min = c;
+	}
+	if (min == 255)
+		return;
+	for (i = 0; i < FREQ_SKETCH_DEPTH; i++) {
+		if (__atomic_load_n(&s->table[idx[i]], __ATOMIC_RELAXED) == min)
+			__atomic_store_n(&s->table[idx[i]], min + 1, __ATOMIC_RELAXED);
+	}
+
+	/* Only the thread reaching the sample size halves the counters. */
+	if (__atomic_add_fetch(&s->additions, 1, __ATOMIC_RELAXED)
+			== s->sample_size) {
+		sketchReset(s);
+		__atomic_store_n(&s->additions, s->sample_size / 2, __ATOMIC_RELAXED);
+	}
+}
+
+/* Return the estimated access frequency of the key with the specified
+ * hash. */
+unsigned int sketchEstimate(frequencySketch *s, uint64_t hash) {
+	unsigned long idx[FREQ_SKETCH_DEPTH];
+	unsigned int min = 255;
+	int i;
+
+	sketchIndexes(s, hash, idx);
+	for (i = 0; i < FREQ_SKETCH_DEPTH; i++) {
+		unsigned int c = __atomic_load_n(&s->table[idx[i]], __ATOMIC_RELAXED);
+
+		if (c < min)
+			min = c;
+	}
+	return min;
+}
+
+/*-----------------------------------------------------------------------------
+ * Eviction
+ *----------------------------------------------------------------------------*/
+
+void evictionPoolInit(memoryDb *db) {
+	db->eviction_pool = zcalloc(sizeof(struct evictionPoolEntry) * EVPOOL_SIZE);
+}
+
+/* Return the value used to rank the item: keys with the greater value are
+ * evicted first. */
+static unsigned long long evictionScore(item *it, int policy) {
+	if (policy == MAXMEMORY_VOLATILE_TTL) {
+		/* The sooner the key expires the better */
+		return ULLONG_MAX - it->expire;
+	} else if (policy & MAXMEMORY_FLAG_LFU) {
+		/* The less frequently accessed the better */
+		return 255 - valueLFUCounter(&it->val);
+	}
+	return (unsigned) (LRU_CLOCK()
+			- __atomic_load_n(&it->val.lru, __ATOMIC_RELAXED));
+}
+
+/* Sample MAXMEMORY_SAMPLES keys and add them to the pool if they are better
+ * candidates than the ones already there. Entries are sorted by ascending
+ * idle time, empty entries are at the end. */
+static void evictionPoolPopulate(memoryDb *db, int policy,
+		struct evictionPoolEntry *pool) {
+	int j, k;
+
+	for (j = 0; j < MAXMEMORY_SAMPLES; j++) {
+		unsigned long long idle;
+		item *it;
+
+		if (policy & MAXMEMORY_FLAG_ALLKEYS) {
+			it = entryItem(dictGetRandomKey(db->dict));
+		} else {
+			it = db->expires[random() % db->expires_count];
+		}
+		idle = evictionScore(it, policy);
+
+		/* Find the first empty entry or the first entry with a smaller
+		 * idle time than our key. */
+		k = 0;
+		while (k < EVPOOL_SIZE && pool[k].key && pool[k].idle < idle)
+			k++;
+		if (k == 0 && pool[EVPOOL_SIZE-1].key != NULL) {
+			/* Worse than all the candidates and the pool is full */
+			continue;
+		} else if (k < EVPOOL_SIZE && pool[k].key == NULL) {
+			/* Empty entry, just insert */
+		} else if (pool[EVPOOL_SIZE-1].key == NULL) {
+			/* Free space on the right: shift the entries from k */
+			memmove(pool+k+1, pool+k,
+					sizeof(pool[0]) * (EVPOOL_SIZE-k-1));
+		} else {
+			/* No free space: drop the worst entry on the left */
+			k--;
+			sdsfree(pool[0].key);
+			memmove(pool, pool+1, sizeof(pool[0]) * k);
+		}
+		pool[k].key = sdsdup(itemKey(it));
+		pool[k].idle = idle;
+	}
+}
+
+/* Evict keys of the DB according to 'policy' until at least 'tofree' bytes
+ * are released, or '*maxkeys' keys were evicted, or no key can be evicted.
+ * '*maxkeys' is decremented for every evicted key, so the effort can be
+ * bounded across several DBs.
+ *
+ * If 'admitfreq' is not negative it is the estimated frequency of the key
+ * about to be written (see the TinyLFU section): when the key to evict is
+ * more popular nothing else is evicted, and '*maxkeys' is set to zero.
+ *
+ * Returns the bytes released. With concurrent readers the memory is freed
+ * later, when no reader can access it (see epoch.h). */
+size_t evictKeys(memoryDb *db, int policy, size_t tofree, long *maxkeys,
+		long admitfreq) {
+	struct evictionPoolEntry *pool = db->eviction_pool;
+	size_t freed = 0;
+
+	if (policy == MAXMEMORY_NO_EVICTION)
+		return 0;
+	while (freed < tofree && *maxkeys > 0) {
+		item *victim = NULL;
+		sds key;
+		int k;
+
+		if (policy & MAXMEMORY_FLAG_ALLKEYS ? dictSize(db->dict) == 0
+				: db->expires_count == 0)
+			break;
+		evictionPoolPopulate(db, policy, pool);
+
+		/* Go backward from the best to the worst candidate: keys may have
+		 * been deleted or made persistent since they entered the pool. */
+		for (k = EVPOOL_SIZE-1; k >= 0 && victim == NULL; k--) {
+			dictEntry *de;
+
+			if (pool[k].key == NULL)
+				continue;
+			de = dictFind(db->dict, pool[k].key);
+			sdsfree(pool[k].key);
+			pool[k].key = NULL;
+			if (de && (policy & MAXMEMORY_FLAG_ALLKEYS
+					|| entryItem(de)->expire != -1))
+				victim = entryItem(de);
+		}
+		if (victim == NULL)
+			continue;
+
+		key = itemKey(victim);
+		if (admitfreq >= 0 && db->sketch && sketchEstimate(db->sketch,
+				dictGenHashFunction(key, sdslen(key))) > admitfreq) {
+			*maxkeys = 0;
+			break;
+		}
+		freed += itemMemoryUsage(victim);
+		dbDelete(db, key, sdslen(key));
+		db->stats.evictedkeys++;
+		(*maxkeys)--;
+	}
+	return freed;
+}
+
+#ifdef EVICT_BENCHMARK_MAIN
+
+#include <math.h>
+#include <string.h>
+
+#include "mdb.h"
+
+/* Hit ratio of the eviction policies on a trace of reads, used as a read
+ * through cache: keys are set after a miss.
+ *
+ * The trace is read from a file, one key per line, or generated: reads of
+ * BENCHMARK_KEYS keys with a Zipfian distribution, interleaved with scans
+ * of keys that are read only once. */
+
+#define BENCHMARK_KEYS 1000000
+#define BENCHMARK_READS 5000000
+#define BENCHMARK_ZIPF_S 0.99
+#define BENCHMARK_SCAN_EVERY 250000 /* Reads between scans */
+#define BENCHMARK_SCAN_LEN 50000 /* Keys read by every scan */
+
+static uint64_t benchmark_seed = 0x2545f4914f6cdd1dULL;
+
+static double benchmarkRandom(void) {
+	benchmark_seed ^= benchmark_seed << 13;
+	benchmark_seed ^= benchmark_seed >> 7;
+	benchmark_seed ^= benchmark_seed << 17;
+	return (double) (benchmark_seed >> 11) / (double) (1ULL << 53);
+}
+
+static sds *generateTrace(long *len) {
+	double *cdf = zmalloc(sizeof(double) * BENCHMARK_KEYS), sum = 0;
+	sds *trace = zmalloc(sizeof(sds) * (BENCHMARK_READS
+			+ BENCHMARK_READS / BENCHMARK_SCAN_EVERY * BENCHMARK_SCAN_LEN));
+	long j, n = 0, scanned = 0;
+
+	for (j = 0; j < BENCHMARK_KEYS; j++) {
+		sum += 1.0 / pow(j + 1, BENCHMARK_ZIPF_S);
+		cdf[j] = sum;
+	}
+	for (j = 0; j < BENCHMARK_READS; j++) {
+		double r = benchmarkRandom() * sum;
+		long lo = 0, hi = BENCHMARK_KEYS - 1;
+
+		while (lo < hi) {
+			long mid = (lo + hi) / 2;
+
+			if (cdf[mid] < r)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		trace[n++] = sdscatprintf(sdsempty(), "key:%ld", lo);
+		if ((j + 1) % BENCHMARK_SCAN_EVERY == 0) {
+			long k;
+
+			for (k = 0; k < BENCHMARK_SCAN_LEN; k++)
+				trace[n++] = sdscatprintf(sdsempty(), "scan:%ld", scanned++);
+		}
+	}
+	zfree(cdf);
+	*len = n;
+	return trace;
+}
+
+static sds *loadTrace(const char *filename, long *len) {
+	FILE *fp = fopen(filename, "r");
+	sds *trace = NULL;
+	long n = 0, size = 0;
+	char buf[1024];
+
+	if (fp == NULL) {
+		perror(filename);
+		exit(1);
+	}
+	while (fgets(buf, sizeof(buf), fp)) {
+		sds key = sdstrim(sdsnew(buf), "\r\n");
+
+		if (n == size) {
+			size = size ? size * 2 : 1024;
+			trace = zrealloc(trace, sizeof(sds) * size);
+		}
+		trace[n++] = key;
+	}
+	fclose(fp);
+	*len = n;
+	return trace;
+}
+
+/* Size maxmemory to hold about 'keys' keys of the trace. */
+static size_t benchmarkMaxmemory(long keys) {
+	size_t base = zmalloc_used_memory();
+	char key[32];
+	long j;
+
+	for (j = 0; j < keys; j++) {
+		snprintf(key, sizeof(key), "key:%ld", j);
+		set(key, "some value here", 0);
+	}
+	base = zmalloc_used_memory() - base;
+	flush_all();
+	return zmalloc_used_memory() + base;
+}
+
+/* evict-benchmark [cache size in keys] [trace file|-] [chained|open] */
+int main(int argc, char **argv) {
+	struct {
+		const char *name;
+		int policy, admission;
+	} runs[] = {
+		{"allkeys-lru", MDB_ALLKEYS_LRU, 0},
+		{"allkeys-lfu", MDB_ALLKEYS_LFU, 0},
+		{"allkeys-lru + TinyLFU", MDB_ALLKEYS_LRU, 1},
+		{"allkeys-lfu + TinyLFU", MDB_ALLKEYS_LFU, 1}
+	};
+	long cachesize = BENCHMARK_KEYS / 20, len, j;
+	int engine = DICT_ENGINE_CHAINED, i;
+	sds *trace;
+
+	if (argc > 1) cachesize = atol(argv[1]);
+	if (argc > 2 && strcmp(argv[2], "-"))
+		trace = loadTrace(argv[2], &len);
+	else
+		trace = generateTrace(&len);
+	if (argc > 3 && !strcmp(argv[3], "open")) engine = DICT_ENGINE_OPEN;
+
+	initMdb(16, engine, 0);
+	printf("%ld reads, cache of %ld keys\n", len, cachesize);
+	for (i = 0; i < (int) (sizeof(runs) / sizeof(runs[0])); i++) {
+		long long start = ustime(), hits = 0;
+		stats_t st0, st;
+
+		flush_all();
+		mdbSetMaxmemory(0, runs[i].policy);
+		mdbSetAdmission(runs[i].admission ? cachesize : 0);
+		mdbSetMaxmemory(benchmarkMaxmemory(cachesize), runs[i].policy);
+		mdbGetStats(&st0);
+		for (j = 0; j < len; j++) {
+			if (get(trace[j]))
+				hits++;
+			else
+				set(trace[j], "some value here", 0);
+		}
+		mdbGetStats(&st);
+		printf("%-24s hit ratio %5.2f%%, %lld evicted, %lld not admitted "
+				"(%.0f reads/sec)\n", runs[i].name,
+				(double) hits * 100 / len, st.evictedkeys - st0.evictedkeys,
+				st.admission_rejects - st0.admission_rejects,
+				(double) len * 1000000 / (ustime() - start));
+	}
+	return 0;
+}
+#endif
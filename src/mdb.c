@@ -1,180 +1,1489 @@
+#include "fmacros.h"
 #include "mdb.h"
+#include "epoch.h"
 
-static memoryDb *db = NULL;
+#include <sys/wait.h>
+#include <unistd.h>
 
-static sds *sdsinitbuf(void *buf, size_t buflen, void *init, size_t initlen) {
-	struct sdshdr *sh;
-	if (buflen != (sizeof(*sh) + initlen + 1)) return NULL;
-	sh = (struct sdshdr *) buf;
-	sh->len = initlen;
-	sh->free = 0;
-	memcpy(sh->buf, init, initlen);
-	sh->buf[initlen] = '\0';
-	return (char *)sh->buf;
+/* The keyspace is split in numslots DBs (slots), every key is owned by the
+ * slot selected by its hash. Slots are independent: each one has its own
+ * dict, expires and lock, so commands against different slots run in
+ * parallel. */
+static memoryDb **slots = NULL;
+static int numslots = 0;
+
+/* Microseconds mdbCron() can spend rehashing and expiring keys at every
+ * call. */
+static long long rehash_budget = MDB_DEFAULT_REHASH_BUDGET;
+static long long expire_budget = MDB_DEFAULT_EXPIRE_BUDGET;
+static long long slabs_budget = MDB_DEFAULT_SLABS_BUDGET;
+
+/* Chunk size growth factor of the slab allocator, see MDB_SLABS. */
+static double slab_factor = SLAB_DEFAULT_FACTOR;
+
+/* Memory limit in bytes, 0 for no limit, see mdbSetMaxmemory(). The
+ * eviction policy is in evict.c. */
+static size_t maxmemory = 0;
+
+/* The bgsave() child, -1 if none, with the pipe it sends the snapshotInfo
+ * of the snapshot to, and the stats of the snapshots, protected by
+ * snapshot_lock. */
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static pid_t snapshot_child = -1;
+static int snapshot_pipe = -1;
+static snapshotInfo last_snapshot;
+static long long snapshots = 0, snapshot_failures = 0, fork_time = 0;
+
+/* Return the slot owning the key with hash 'h'. The slot is selected with
+ * the high bits of the hash, since the low bits address the buckets of the
+ * slot dict. The slot dicts hash the keys with dictGenHashFunction() as
+ * well, so the same hash can be used for the lookup. */
+static memoryDb *hashSlot(uint64_t h) {
+	return slots[((h >> 32) * numslots) >> 32];
 }
 
-#define SDS_NEW_IN_STK(init, out) \
-		size_t buflen = strlen(init) + 1 + sizeof(struct sdshdr); \
-		char buf[buflen]; \
-		out = sdsinitbuf(buf, buflen, init, strlen(init));
+static memoryDb *keySlot(const char *k, size_t klen) {
+	return hashSlot(dictGenHashFunction(k, klen));
+}
 
-static bool incrDecrCommand(memoryDb *db, sds *key, long long incr) {
-	long long v, oldvalue;
-	value_t *o, *new;
+/* Lock and return the slot owning the key. With concurrent readers this
+ * is also where the values returned by get() to this thread are released.
+ * With MDB_ARENAS the thread allocates from the arena of the slot until it
+ * is unlocked. */
+static memoryDb *lockSlot(memoryDb *db) {
+	if (db->flags & DB_CONCURRENT)
+		epochExit();
+	pthread_mutex_lock(&db->lock);
+	zmalloc_set_thread_arena(db->arena);
+	return db;
+}
 
-	o = lookupKeyWrite(db, key);
-	if (getLongLongFromValue(o, &v) != MDB_OK)
-		return false;
+static memoryDb *lockKeySlot(const char *k, size_t klen) {
+	return lockSlot(keySlot(k, klen));
+}
+
+/* Unlock a slot. The arena of the thread is left alone when unlocking a
+ * slot locked without switching to its arena, like the slots locked
+ * together by lockSlots() but the one written last. */
+static void unlockSlot(memoryDb *db) {
+	if (zmalloc_get_thread_arena() == db->arena)
+		zmalloc_set_thread_arena(ZMALLOC_NO_ARENA);
+	pthread_mutex_unlock(&db->lock);
+}
+
+/* Evict keys if the used memory is over maxmemory. Called with the lock of
+ * 'db' held before writing to it.
+ *
+ * Keys are evicted from 'db' first, so no other lock is needed in the
+ * common case, then from the other slots that are not busy. At most
+ * MAXMEMORY_EVICTION_MAX_KEYS keys are evicted per write, so a write never
+ * stalls for long: if the memory is still over the limit, the next writes
+ * will evict more.
+ *
+ * With the admission filter enabled (see mdbSetAdmission()) a new key is
+ * only admitted if it is estimated to be at least as popular as the first
+ * key to evict.
+ *
+ * Returns false if the write should be refused: memory is over the limit
+ * and no key could be evicted, or the key was not admitted. */
+static bool freeMemoryIfNeeded(memoryDb *db, const char *k, size_t klen) {
+	long maxkeys = MAXMEMORY_EVICTION_MAX_KEYS, admitfreq = -1;
+	size_t used, tofree, freed;
+	long long start;
+	int j;
 
-	oldvalue = v;
-	if ((incr < 0 && oldvalue < 0 && incr < (LLONG_MIN - oldvalue))
-			|| (incr > 0 && oldvalue > 0 && incr > (LLONG_MAX - oldvalue))) {
+	if (maxmemory == 0 || (used = zmalloc_used_memory()) <= maxmemory)
+		return true;
+	if (maxmemory_policy == MAXMEMORY_NO_EVICTION) {
+		db->stats.rejected_writes++;
 		return false;
 	}
-	v += incr;
-	new = createValueFromLongLong(v);
-	if (o)
-		dbOverwrite(db, key, new);
-	else
-		dbAdd(db, key, new);
 
+	start = ustime();
+	if (db->sketch && !dbExists(db, k, klen))
+		admitfreq = sketchEstimate(db->sketch, dictGenHashFunction(k, klen));
+	tofree = used - maxmemory;
+	freed = evictKeys(db, maxmemory_policy, tofree, &maxkeys, admitfreq);
+	for (j = 1; j < numslots && freed < tofree && maxkeys > 0; j++) {
+		memoryDb *other = slots[(db->id + j) % numslots];
+
+		if (pthread_mutex_trylock(&other->lock) != 0)
+			continue;
+		/* Free the keys to the arena of their slot, then go back to the
+		 * arena of the slot written. */
+		zmalloc_set_thread_arena(other->arena);
+		freed += evictKeys(other, maxmemory_policy, tofree - freed, &maxkeys,
+				admitfreq);
+		zmalloc_set_thread_arena(db->arena);
+		pthread_mutex_unlock(&other->lock);
+	}
+	db->stats.eviction_time += ustime() - start;
+	if (freed == 0) {
+		/* Nothing evicted and maxkeys zeroed: the victim won */
+		if (admitfreq >= 0 && maxkeys == 0)
+			db->stats.admission_rejects++;
+		db->stats.rejected_writes++;
+		return false;
+	}
 	return true;
 }
 
-bool initMdb(int numSlots) {
-	if (db == NULL) return true;
-	db = memoryDbNew(numSlots);
-	if (db == NULL) return false;
-	else return true;
+/* Lock the slot 'db' owning the key to modify it. Returns NULL, with no
+ * lock held, if the write is refused because of maxmemory. */
+static memoryDb *lockSlotForWrite(memoryDb *db, const char *k, size_t klen) {
+	lockSlot(db);
+	if (!freeMemoryIfNeeded(db, k, klen)) {
+		unlockSlot(db);
+		return NULL;
+	}
+	return db;
+}
+
+static memoryDb *lockKeySlotForWrite(const char *k, size_t klen) {
+	return lockSlotForWrite(keySlot(k, klen), k, klen);
+}
+
+/* Lock the distinct slots of 'db', 'count' slots with repetitions, in slot
+ * order like slabsCron() does, so that no thread locking many slots waits
+ * for another while holding one. The slots are stored in 'locked', to be
+ * unlocked with unlockSlot(), and their number is returned. */
+static size_t lockSlots(memoryDb **db, size_t count, memoryDb **locked) {
+	size_t j, i, nlocked = 0;
+
+	for (j = 0; j < count; j++) {
+		for (i = 0; i < nlocked && locked[i]->id < db[j]->id; i++)
+			;
+		if (i < nlocked && locked[i] == db[j])
+			continue;
+		memmove(locked + i + 1, locked + i, (nlocked - i) * sizeof(memoryDb*));
+		locked[i] = db[j];
+		nlocked++;
+	}
+	for (i = 0; i < nlocked; i++)
+		pthread_mutex_lock(&locked[i]->lock);
+	return nlocked;
+}
+
+/* Refresh the cached clock of db.c every MDB_CLOCK_RESOLUTION
+ * milliseconds. */
+static void *clockThread(void *arg) {
+	DICT_NOTUSED(arg);
+	while (1) {
+		updateCachedTime();
+		usleep(MDB_CLOCK_RESOLUTION * 1000);
+	}
+	return NULL;
+}
+
+/* Initialize the library with 'numSlots' independent slots, the number of
+ * threads that can modify the keyspace at the same time. 'engine' is the
+ * hash table implementation of the keyspace: DICT_ENGINE_CHAINED or
+ * DICT_ENGINE_OPEN.
+ *
+ * With the MDB_CONCURRENT flag get() doesn't take the slot lock, so reads
+ * never wait for writers, see get().
+ *
+ * Unless MDB_PRECISE_CLOCK is given, TTLs are checked against a cached
+ * clock refreshed by a background thread, see cachedMstime().
+ *
+ * With MDB_SLABS keys and values up to SLAB_CHUNK_MAX bytes are stored in a
+ * slab allocator, see slabs.h and mdbSetSlabFactor().
+ *
+ * With MDB_ARENAS, and jemalloc, every slot allocates from its own arena,
+ * so writers of different slots don't contend in the allocator, and the
+ * memory of every slot is reported by mdbGetSlotMemory(). The memory of a
+ * slot is freed with its arena selected on every path, objects retired for
+ * concurrent readers included. Allocations from an arena skip the thread
+ * cache (see zmalloc.c): the flag pays off with many writers spread over
+ * the slots, while with few writers it can be slower. */
+bool initMdb(int numSlots, int engine, int flags) {
+	pthread_t tid;
+	int j;
+
+	if (slots != NULL) return true;
+	if (numSlots < 1) numSlots = 1;
+	zmalloc_enable_thread_safeness();
+	if (flags & MDB_SLABS)
+		slabsInit(slab_factor);
+	slots = zmalloc(sizeof(memoryDb*) * numSlots);
+	for (j = 0; j < numSlots; j++) {
+		slots[j] = memoryDbNew(j, engine, flags);
+	}
+	numslots = numSlots;
+	if (!(flags & MDB_PRECISE_CLOCK) &&
+			pthread_create(&tid, NULL, clockThread, NULL) == 0) {
+		pthread_detach(tid);
+		setPreciseClock(0);
+	}
+	return true;
 }
 
+/* Note that the returned value is owned by the keyspace: it can be
+ * modified or freed as soon as the key is written by another thread.
+ *
+ * With MDB_CONCURRENT the lookup runs without locks. Values are never
+ * modified in place and the thread stays in its epoch after returning, so
+ * the value stays valid until the next call of the same thread. Only
+ * integers are updated in place by incr() and decr(): read them with
+ * getLongLongFromValue() or valueToSds(), that also decompresses the values
+ * compressed by mdbSetCompression(). Threads going idle should call
+ * mdbThreadOffline(), otherwise the memory of deleted and overwritten keys
+ * is not freed until their next call. Threads exiting are taken offline
+ * automatically. */
 value_t *get(const char *k) {
-    sds *key = sdsnew(k);
-    value_t *val = lookupKeyRead(db, key);
-    if (!val) {
-    	return NULL;
-    } else {
-    	return val;
-    }
+	return getWithCas(k, NULL);
+}
+
+/* Like get(), also setting '*cas', if not NULL, to the CAS id of the value
+ * (0 if the key doesn't exist), to pass to cas(). This is the memcached
+ * gets command. */
+value_t *getWithCas(const char *k, uint64_t *cas) {
+	size_t klen = strlen(k);
+	uint64_t h = dictGenHashFunction(k, klen);
+	memoryDb *db = hashSlot(h);
+	value_t *val;
+
+	/* Hits and misses alike count for the admission of the key */
+	if (db->sketch)
+		sketchIncrement(db->sketch, h);
+	if (db->flags & DB_CONCURRENT) {
+		epochEnter();
+		val = lookupKeyReadConcurrentWithHash(db, k, klen, h);
+		if (cas)
+			*cas = val ? valueCas(val) : 0;
+	} else {
+		lockSlot(db);
+		val = lookupKeyReadWithHash(db, k, klen, h);
+		if (cas)
+			*cas = val ? val->cas : 0;
+		unlockSlot(db);
+	}
+	return val;
+}
+
+/* Lookup a key and pin its value: pv->ptr and pv->len are set to the
+ * bytes of the value, that stay valid until releasePinned() is called,
+ * even if meanwhile the key is overwritten or deleted, and even after other
+ * calls of the thread. So large values can be written to a socket with no
+ * copy. Returns false if the key doesn't exist. Values stored as ropes (see
+ * MDB_ROPES) are made contiguous first, getPinnedIov() avoids that.
+ *
+ * Integers and tiny strings are copied to pv->buf instead, so 'pv' must not
+ * be moved while it is in use, and compressed values (see
+ * mdbSetCompression()) are decompressed to pv->copy. Other values are
+ * protected with an epoch pin (see epoch.h): until all the pins are released
+ * the memory of overwritten and deleted keys is not freed, and without
+ * MDB_CONCURRENT values are copied rather than modified in place, so pins
+ * should be held briefly. */
+bool getPinned(const char *k, mdbPinnedValue *pv) {
+	size_t klen = strlen(k);
+	uint64_t h = dictGenHashFunction(k, klen);
+	memoryDb *db = hashSlot(h);
+	value_t *val;
+
+	if (db->sketch)
+		sketchIncrement(db->sketch, h);
+	/* Taken before the lookup, so that it protects the item found */
+	pv->pin = epochPin();
+	pv->copy = NULL;
+	if (db->flags & DB_CONCURRENT) {
+		val = lookupKeyReadConcurrentWithHash(db, k, klen, h);
+		if (val) {
+			/* Before the value, see valueCas() */
+			pv->cas = valueCas(val);
+			pv->ptr = valueString(val, pv->buf, &pv->len, &pv->copy);
+		}
+	} else {
+		lockSlot(db);
+		val = lookupKeyReadWithHash(db, k, klen, h);
+		if (val) {
+			pv->ptr = valueString(val, pv->buf, &pv->len, &pv->copy);
+			pv->cas = val->cas;
+		}
+		unlockSlot(db);
+	}
+	/* Copies need no pin */
+	if (val == NULL || pv->ptr == pv->buf || pv->copy) {
+		epochUnpin(pv->pin);
+		pv->pin = 0;
+	}
+	return val != NULL;
+}
+
+/* Like getPinned(), setting up to 'max' iovecs to the bytes of the value,
+ * for writev(), rather than pv->ptr, that is left NULL. Values stored as
+ * ropes (see MDB_ROPES) are returned with no copy, an iovec per segment,
+ * unless they have more than 'max' segments: then they are flattened, as
+ * getPinned() does. 'max' must be at least 1. pv->len is the length of
+ * the whole value. Returns the number of iovecs set, 0 if the key doesn't
+ * exist. */
+int getPinnedIov(const char *k, mdbPinnedValue *pv, struct iovec *iov,
+		int max) {
+	size_t klen = strlen(k);
+	uint64_t h = dictGenHashFunction(k, klen);
+	memoryDb *db = hashSlot(h);
+	value_t *val;
+	int n = 0, j;
+
+	if (db->sketch)
+		sketchIncrement(db->sketch, h);
+	pv->pin = epochPin();
+	pv->ptr = NULL;
+	pv->copy = NULL;
+	if (db->flags & DB_CONCURRENT) {
+		val = lookupKeyReadConcurrentWithHash(db, k, klen, h);
+		if (val) {
+			pv->cas = valueCas(val);
+			n = valueIovec(val, iov, max, pv->buf, &pv->copy);
+		}
+	} else {
+		lockSlot(db);
+		val = lookupKeyReadWithHash(db, k, klen, h);
+		if (val) {
+			pv->cas = val->cas;
+			n = valueIovec(val, iov, max, pv->buf, &pv->copy);
+		}
+		unlockSlot(db);
+	}
+	for (j = 0, pv->len = 0; j < n; j++)
+		pv->len += iov[j].iov_len;
+	if (n == 0 || iov[0].iov_base == pv->buf || pv->copy) {
+		epochUnpin(pv->pin);
+		pv->pin = 0;
+	}
+	return n;
+}
+
+/* Release a value pinned by getPinned(). It can be called by any thread. */
+void releasePinned(mdbPinnedValue *pv) {
+	if (pv->pin)
+		epochUnpin(pv->pin);
+	pv->pin = 0;
+	sdsfree(pv->copy);
+	pv->copy = NULL;
+}
+
+/* Release the values returned by get() to the calling thread. */
+void mdbThreadOffline(void) {
+	epochExit();
+}
+
+/* Lookup the MDB_GET_BATCH keys at most in 'keys'. Without MDB_CONCURRENT
+ * the slots of the keys are locked together, otherwise the caller is
+ * already in its epoch. */
+static size_t getBatch(const char **keys, size_t count, value_t **vals) {
+	size_t klen[MDB_GET_BATCH];
+	uint64_t h[MDB_GET_BATCH];
+	memoryDb *db[MDB_GET_BATCH], *locked[MDB_GET_BATCH];
+	size_t j, i, nlocked = 0, found = 0;
+	int concurrent = slots[0]->flags & DB_CONCURRENT, step;
+
+	for (j = 0; j < count; j++) {
+		klen[j] = strlen(keys[j]);
+		h[j] = dictGenHashFunction(keys[j], klen[j]);
+		db[j] = hashSlot(h[j]);
+		if (db[j]->sketch)
+			sketchIncrement(db[j]->sketch, h[j]);
+	}
+	if (!concurrent)
+		nlocked = lockSlots(db, count, locked);
+
+	for (step = DICT_PREFETCH_BUCKET; step <= DICT_PREFETCH_KEY; step++) {
+		for (j = 0; j < count; j++)
+			dictPrefetch(db[j]->dict, h[j], step);
+	}
+	for (j = 0; j < count; j++) {
+		if (concurrent) {
+			vals[j] = lookupKeyReadConcurrentWithHash(db[j], keys[j], klen[j],
+					h[j]);
+		} else {
+			/* Expired keys are freed to the arena of their slot */
+			zmalloc_set_thread_arena(db[j]->arena);
+			vals[j] = lookupKeyReadWithHash(db[j], keys[j], klen[j], h[j]);
+		}
+		found += vals[j] != NULL;
+	}
+
+	for (i = 0; i < nlocked; i++)
+		unlockSlot(locked[i]);
+	return found;
 }
 
-void gets() {
+/* Lookup 'count' keys at once: vals[j] is set to the value of keys[j], or
+ * to NULL if the key doesn't exist. Returns the number of keys found. The
+ * values stay valid as the ones returned by get().
+ *
+ * Looking up keys one at a time every step waits for a cache miss: the
+ * bucket, the entry, then the key. Here the keys are processed in batches
+ * of MDB_GET_BATCH, every step is performed for all the keys of the batch
+ * and prefetches the memory of the next step, see dictPrefetch(), so the
+ * misses of different keys overlap. */
+size_t getMulti(const char **keys, size_t count, value_t **vals) {
+	size_t j, found = 0;
 
+	/* Entered once: entering again would release the values of the
+	 * previous batches */
+	if (slots[0]->flags & DB_CONCURRENT)
+		epochEnter();
+	for (j = 0; j < count; j += MDB_GET_BATCH) {
+		size_t n = count - j < MDB_GET_BATCH ? count - j : MDB_GET_BATCH;
+
+		found += getBatch(keys + j, n, vals + j);
+	}
+	return found;
 }
 
 bool set(const char *k, const char *v, long expire) {
-	sds *key = sdsnew(k);
-	value_t *val = createValueFromStr(v, strlen(v));
-	setKey(db, key, val);
-	if (expire)
-		setExpire(db, key, expire);
+	size_t klen = strlen(k);
+	uint64_t h = dictGenHashFunction(k, klen);
+	memoryDb *db = lockSlotForWrite(hashSlot(h), k, klen);
+
+	if (db == NULL)
+		return false;
+
+	setKeyWithHash(db, k, klen, h, v, strlen(v), expire);
+	unlockSlot(db);
 	return true;
 }
 
+/* Write the MDB_SET_BATCH keys at most in 'keys', see setMulti(). */
+static size_t setBatch(const char **keys, const char **vals,
+		const long *expires, size_t count) {
+	size_t klen[MDB_SET_BATCH];
+	uint64_t h[MDB_SET_BATCH];
+	memoryDb *db[MDB_SET_BATCH], *locked[MDB_SET_BATCH];
+	size_t j, i, nlocked, written = 0;
+	int step;
+
+	for (j = 0; j < count; j++) {
+		klen[j] = strlen(keys[j]);
+		h[j] = dictGenHashFunction(keys[j], klen[j]);
+		db[j] = hashSlot(h[j]);
+	}
+	nlocked = lockSlots(db, count, locked);
+
+	for (step = DICT_PREFETCH_BUCKET; step <= DICT_PREFETCH_KEY; step++) {
+		for (j = 0; j < count; j++)
+			dictPrefetch(db[j]->dict, h[j], step);
+	}
+	for (j = 0; j < count; j++) {
+		zmalloc_set_thread_arena(db[j]->arena);
+		if (!freeMemoryIfNeeded(db[j], keys[j], klen[j]))
+			continue;
+		setKeyWithHash(db[j], keys[j], klen[j], h[j], vals[j],
+				strlen(vals[j]), expires ? expires[j] : 0);
+		written++;
+	}
+
+	for (i = 0; i < nlocked; i++)
+		unlockSlot(locked[i]);
+	return written;
+}
+
+/* Set 'count' keys at once: keys[j] is set to vals[j] like set() does,
+ * with the expire expires[j] if 'expires' is not NULL. Returns the number
+ * of keys written: like with set() a write can be refused because of
+ * maxmemory.
+ *
+ * The keys are written in batches of MDB_SET_BATCH. The slots of a batch
+ * are locked once, the buckets of the keys are prefetched, like getMulti()
+ * does, and every key is looked up just once. Before writing many keys the
+ * slot dicts are expanded to make room for them at once, see dictReserve().
+ *
+ * Writes of different keys are not atomic as a whole: other threads can
+ * see some of them before the others. */
+size_t setMulti(const char **keys, const char **vals, const long *expires,
+		size_t count) {
+	size_t j, written = 0;
+
+	if (count > MDB_SET_BATCH) {
+		unsigned long *perslot = zcalloc(sizeof(unsigned long) * numslots);
+		int id;
+
+		for (j = 0; j < count; j++)
+			perslot[hashSlot(dictGenHashFunction(keys[j],
+					strlen(keys[j])))->id]++;
+		for (id = 0; id < numslots; id++) {
+			if (perslot[id] == 0)
+				continue;
+			lockSlot(slots[id]);
+			dictReserve(slots[id]->dict, perslot[id]);
+			unlockSlot(slots[id]);
+		}
+		zfree(perslot);
+	}
+	if (slots[0]->flags & DB_CONCURRENT)
+		epochExit();
+	for (j = 0; j < count; j += MDB_SET_BATCH) {
+		size_t n = count - j < MDB_SET_BATCH ? count - j : MDB_SET_BATCH;
+
+		written += setBatch(keys + j, vals + j, expires ? expires + j : NULL,
+				n);
+	}
+	return written;
+}
+
 bool add(const char *k, const char *v, long expire) {
-	sds *key = sdsnew(k);
-	value_t *val = createValueFromStr(v, strlen(v));
-	if (lookupKeyWrite(db, key) != NULL) {
+	size_t klen = strlen(k);
+	memoryDb *db = lockKeySlotForWrite(k, klen);
+
+	if (db == NULL)
+		return false;
+
+	if (lookupKeyWrite(db, k, klen) != NULL) {
+		unlockSlot(db);
 		return false;
 	}
-	setKey(db, key, val);
+	setKey(db, k, klen, v, strlen(v));
 	if (expire)
-		setExpire(db, key, expire);
+		setExpire(db, k, klen, expire);
+	unlockSlot(db);
 	return true;
 }
 
 bool replace(const char *k, const char *v, long expire) {
-	sds *key = sdsnew(k);
-		value_t *val = createValueFromStr(v, strlen(v));
-	if (lookupKeyWrite(db, key) == NULL) {
+	size_t klen = strlen(k);
+	memoryDb *db = lockKeySlotForWrite(k, klen);
+
+	if (db == NULL)
+		return false;
+
+	if (lookupKeyWrite(db, k, klen) == NULL) {
+		unlockSlot(db);
 		return false;
 	}
-	setKey(db, key, val);
+	setKey(db, k, klen, v, strlen(v));
 	if (expire)
-		setExpire(db, key, expire);
+		setExpire(db, k, klen, expire);
+	unlockSlot(db);
 	return true;
 }
 
-int append(const char *k, const char *suffix,) {
-	size_t totlen;
+size_t append(const char *k, const char *suffix) {
+	size_t totlen, suffixlen = strlen(suffix);
 	value_t *val;
-	sds *key = sdsnew(k);
+	size_t klen = strlen(k);
+	memoryDb *db = lockKeySlotForWrite(k, klen);
+
+	if (db == NULL)
+		return 0;
 
-	val = lookupKeyWrite(db, key);
+	val = lookupKeyWrite(db, k, klen);
 	if (val == NULL) {
-		value_t *suffix_val = createValueFromStr(suffix, strlen(suffix));
 		/* Create the key */
-		dbAdd(db, key, suffix_val);
-	} else {
-		if (!toStringValue()) return false;
-		/* "append" is an argument, so always an sds */
-		totlen = stringObjectLen(val) + strlen(suffix);
+		dbAdd(db, k, klen, suffix, suffixlen);
+		totlen = suffixlen;
+	} else if (dbItemsShared(db)) {
+		/* Readers may be accessing the value, replace it */
+		sds s = sdscatlen(valueToSds(val), suffix, suffixlen);
 
-		/* Append the value */
-		val->ptr = sdscatlen(val->ptr, suffix, strlen(suffix));
-		totlen = sdslen(val->ptr);
+		totlen = sdslen(s);
+		dbOverwrite(db, k, klen, s, totlen);
+		sdsfree(s);
+	} else {
+		totlen = valueAppend(db, val, suffix, suffixlen, 0);
 	}
+	unlockSlot(db);
 	return totlen;
 }
 
-void prepend(const char *k, const char *prefix) {
-	size_t totlen;
+size_t prepend(const char *k, const char *prefix) {
+	size_t totlen, prefixlen = strlen(prefix);
 	value_t *val;
-	sds *key = sdsnew(k);
-	value_t *prefix_val = createValueFromStr(prefix, strlen(prefix));
+	size_t klen = strlen(k);
+	memoryDb *db = lockKeySlotForWrite(k, klen);
 
-	val = lookupKeyWrite(db, key);
+	if (db == NULL)
+		return 0;
+
+	val = lookupKeyWrite(db, k, klen);
 	if (val == NULL) {
 		/* Create the key */
-		dbAdd(db, key, prefix_val);
-		totlen = strlen(prefix);
-	} else {
+		dbAdd(db, k, klen, prefix, prefixlen);
+		totlen = prefixlen;
+	} else if (dbItemsShared(db)) {
+		/* Readers may be accessing the value, replace it */
+		sds old = valueToSds(val);
+		sds s = sdscatsds(sdsnewlen(prefix, prefixlen), old);
 
-		/* "append" is an argument, so always an sds */
-		append = c->argv[2];
-		totlen = stringObjectLen(o) + sdslen(append->ptr);
-		if (checkStringLength(c, totlen) != REDIS_OK)
-			return;
-
-		/* Prepend the value */
-		o = dbUnshareStringValue(db, key, o);
-		sds prefix_sds = sdsnew(prefix);
-		sds tmp = o->ptr;
-		o->ptr = sdscatsds(prefix_sds, tmp);
-		sdsfree(tmp);
-		totlen = sdslen(o->ptr);
+		sdsfree(old);
+		totlen = sdslen(s);
+		dbOverwrite(db, k, klen, s, totlen);
+		sdsfree(s);
+	} else {
+		totlen = valueAppend(db, val, prefix, prefixlen, 1);
 	}
+	unlockSlot(db);
+	return totlen;
 }
 
 bool delete(const char *k) {
-	sds *key = sdsnew(k);
+	size_t klen = strlen(k);
+	memoryDb *db = lockKeySlot(k, klen);
 	bool ret;
-	expireIfNeeded(db, key);
-	if (dbDelete(db, key)) {
+	expireIfNeeded(db, k, klen);
+	if (dbDelete(db, k, klen)) {
 	    ret = true;
 	} else {
 		ret = false;
 	}
-	sdsfree(key);
+	unlockSlot(db);
 	return ret;
 }
 
-void cas() {
+/* Set the key to 'v' like set(), only if it was not written since its CAS
+ * id 'casid' was read with getWithCas() or getPinned(). Returns MDB_CAS_OK,
+ * MDB_CAS_EXISTS if the key was written meanwhile, MDB_CAS_NOT_FOUND if it
+ * doesn't exist anymore, or MDB_CAS_NOT_STORED if the write was refused
+ * because of maxmemory.
+ *
+ * With MDB_CONCURRENT the CAS id is compared first without the lock, so a
+ * cas() failing because another client won the race, the common case of a
+ * contended key, doesn't lock the slot. The write itself takes the lock:
+ * the other writers of the slot relink entries under the lock, so the item
+ * can't be swapped with a bare atomic. */
+int cas(const char *k, const char *v, long expire, uint64_t casid) {
+	size_t klen = strlen(k);
+	uint64_t h = dictGenHashFunction(k, klen);
+	memoryDb *db = hashSlot(h);
+	int ret;
 
+	if (db->flags & DB_CONCURRENT) {
+		epochEnter();
+		ret = dbCompareCasConcurrent(db, k, klen, h, casid);
+		if (ret != DB_CAS_STORED)
+			return ret;
+	}
+	if (lockSlotForWrite(db, k, klen) == NULL)
+		return MDB_CAS_NOT_STORED;
+	ret = dbCompareAndSet(db, k, klen, h, v, strlen(v), expire, casid);
+	unlockSlot(db);
+	return ret;
 }
 
-bool incr(const char *k) {
-	sds *key = sdsnew(k);
-	bool ret = incrDecrCommand(db, key, 1);
+/* Implements incr() and decr(): the key is looked up once, and integer
+ * values are updated in place, see dbIncrBy(). */
+static bool incrDecrCommand(const char *k, long long incr) {
+	size_t klen = strlen(k);
+	uint64_t h = dictGenHashFunction(k, klen);
+	memoryDb *db = lockSlotForWrite(hashSlot(h), k, klen);
+	long long v;
+	bool ret;
+
+	if (db == NULL)
+		return false;
+	ret = dbIncrBy(db, k, klen, h, incr, &v) == MDB_OK;
+	unlockSlot(db);
 	return ret;
 }
 
+bool incr(const char *k) {
+	return incrDecrCommand(k, 1);
+}
+
 bool decr(const char *k) {
-	sds *key = sdsnew(k);
-	bool ret = incrDecrCommand(db, key, -1);
-	return ret;
+	return incrDecrCommand(k, -1);
 }
 
+/* Delete all the keys. With MDB_ARENAS the memory freed is also returned
+ * to the OS right away. */
 void flush_all() {
-    emptyDb(db, NULL);
+	int j;
+
+	for (j = 0; j < numslots; j++) {
+		lockSlot(slots[j]);
+		emptyDb(slots[j], NULL);
+		zmalloc_arena_purge(slots[j]->arena);
+		unlockSlot(slots[j]);
+	}
+}
+
+/* Account a snapshot written, or failed if 'info' is NULL. Called with
+ * snapshot_lock held. */
+static void snapshotDone(snapshotInfo *info) {
+	if (info == NULL) {
+		snapshot_failures++;
+		return;
+	}
+	snapshots++;
+	last_snapshot = *info;
+}
+
+/* Write all the keys to the snapshot 'filename', see snapshot.c, holding
+ * the locks of all the slots meanwhile, so that the snapshot is a point in
+ * time view of the keyspace: writes wait until it is on disk. Use bgsave()
+ * to keep serving them. Returns false if the file can't be written, or a
+ * bgsave() is in progress. */
+bool save(const char *filename) {
+	snapshotInfo info;
+	int ret, j;
+
+	pthread_mutex_lock(&snapshot_lock);
+	if (snapshot_child != -1) {
+		pthread_mutex_unlock(&snapshot_lock);
+		return false;
+	}
+	for (j = 0; j < numslots; j++)
+		pthread_mutex_lock(&slots[j]->lock);
+	ret = snapshotSave(slots, numslots, filename, &info);
+	for (j = 0; j < numslots; j++)
+		unlockSlot(slots[j]);
+	info.cow = 0;
+	snapshotDone(ret == MDB_OK ? &info : NULL);
+	pthread_mutex_unlock(&snapshot_lock);
+	return ret == MDB_OK;
+}
+
+/* Like save(), in a child process, so that the keyspace can be modified
+ * while the snapshot is written. The slots are locked only for the time of
+ * the fork(), so the child gets a point in time copy of the keyspace. The
+ * memory is shared with the child until either process modifies it: every
+ * page written meanwhile is copied, what the snapshot_cow_bytes stat
+ * reports.
+ *
+ * The end of the child is checked by mdbCron(), that must be called for the
+ * snapshot stats to be updated and for another snapshot to be started.
+ * Returns false if the child can't be started, or a snapshot is already in
+ * progress. */
+bool bgsave(const char *filename) {
+	snapshotInfo info;
+	long long start;
+	int fds[2], j;
+	pid_t pid;
+
+	pthread_mutex_lock(&snapshot_lock);
+	if (snapshot_child != -1 || pipe(fds) == -1) {
+		pthread_mutex_unlock(&snapshot_lock);
+		return false;
+	}
+	for (j = 0; j < numslots; j++)
+		pthread_mutex_lock(&slots[j]->lock);
+	start = ustime();
+	if ((pid = fork()) == 0) {
+		/* The child is left with this thread only, and must not take the
+		 * locks that other threads held at the time of the fork. */
+		close(fds[0]);
+		if (snapshotSave(slots, numslots, filename, &info) != MDB_OK)
+			_exit(1);
+		info.cow = zmalloc_get_private_dirty();
+		_exit(write(fds[1], &info, sizeof(info)) == sizeof(info) ? 0 : 1);
+	}
+	fork_time = ustime() - start;
+	for (j = 0; j < numslots; j++)
+		unlockSlot(slots[j]);
+	close(fds[1]);
+	if (pid == -1) {
+		close(fds[0]);
+		snapshotDone(NULL);
+	} else {
+		snapshot_child = pid;
+		snapshot_pipe = fds[0];
+	}
+	pthread_mutex_unlock(&snapshot_lock);
+	return pid != -1;
+}
+
+/* Account the snapshot of the bgsave() child if it exited. */
+static void checkSnapshotChild(void) {
+	snapshotInfo info;
+	int status, ok;
+	pid_t pid;
+
+	pthread_mutex_lock(&snapshot_lock);
+	if (snapshot_child != -1
+			&& (pid = waitpid(snapshot_child, &status, WNOHANG)) != 0) {
+		ok = pid == snapshot_child && WIFEXITED(status)
+				&& WEXITSTATUS(status) == 0
+				&& read(snapshot_pipe, &info, sizeof(info)) == sizeof(info);
+		snapshotDone(ok ? &info : NULL);
+		close(snapshot_pipe);
+		snapshot_child = -1;
+		snapshot_pipe = -1;
+	}
+	pthread_mutex_unlock(&snapshot_lock);
+}
+
+static void loadKey(void *privdata, const char *k, size_t klen,
+		const char *v, size_t len, long long when) {
+	uint64_t h = dictGenHashFunction(k, klen);
+	memoryDb *db;
+
+	DICT_NOTUSED(privdata);
+	if (when && when <= mstime())
+		return;
+	if ((db = lockSlotForWrite(hashSlot(h), k, klen)) == NULL)
+		return;
+	setKeyWithHash(db, k, klen, h, v, len, when);
+	unlockSlot(db);
+}
+
+/* Load the keys of a snapshot written by save() or bgsave(), replacing the
+ * existing keys with the same names. The keys expired meanwhile are
+ * skipped, and the keys refused because of maxmemory as well. The number
+ * of slots and the flags of the library may differ from the ones of the
+ * snapshot. Returns false, with no key loaded, if the file can't be read or
+ * is damaged. */
+bool load(const char *filename) {
+	long long keys;
+
+	return snapshotLoad(filename, loadKey, NULL, &keys) == MDB_OK;
+}
+
+/* Rehash the dict of a slot for at most 'us' microseconds. Returns the
+ * time spent. */
+static long long rehashSlot(memoryDb *db, long long us) {
+	long long start = ustime(), elapsed;
+	int steps;
+
+	if (!dictIsRehashing(db->dict))
+		return 0;
+	steps = dictRehashMicroseconds(db->dict, us);
+	elapsed = ustime() - start;
+	db->stats.rehash_steps += steps;
+	db->stats.rehash_time += elapsed;
+	return elapsed;
+}
+
+/* Run the active expire cycle of a slot for at most 'us' microseconds.
+ * Returns the time spent. */
+static long long expireSlot(memoryDb *db, long long us) {
+	long long start = ustime();
+
+	if (db->expires_count == 0)
+		return 0;
+	activeExpireCycle(db, us);
+	return ustime() - start;
+}
+
+/* Compact the slab pages for at most 'us' microseconds, see slabs.c. All
+ * the slots are locked while items are moved, in batches of at most
+ * SLAB_REBALANCE_BATCH chunks, so that no item is being created or freed
+ * meanwhile, except the ones retired for concurrent readers. A page still
+ * used after all its items were moved waits for those to be freed, for at
+ * most SLAB_REBALANCE_MAX_PASSES calls. */
+static void slabsCron(long long us) {
+	static slabPage *page = NULL;
+	static unsigned long cursor = 0;
+	static int passes = 0;
+	long long start = ustime();
+
+	while (ustime() - start < us) {
+		void *chunk = NULL;
+		int j, scanned = 0;
+
+		if (page == NULL) {
+			if ((page = slabsRebalanceStart()) == NULL)
+				return;
+			cursor = 0;
+			passes = 0;
+		}
+		for (j = 0; j < numslots; j++)
+			pthread_mutex_lock(&slots[j]->lock);
+		while (scanned++ < SLAB_REBALANCE_BATCH
+				&& (chunk = slabsPageNextUsed(page, &cursor)) != NULL) {
+			item *it = chunk;
+			memoryDb *db = keySlot(itemKey(it), sdslen(itemKey(it)));
+
+			/* Values copied or freed belong to the arena of the slot */
+			zmalloc_set_thread_arena(db->arena);
+			dbMoveItem(db, it);
+		}
+		for (j = 0; j < numslots; j++)
+			unlockSlot(slots[j]);
+
+		if (chunk == NULL) {
+			/* The whole page was visited */
+			if (!slabsRebalanceEnd(page, ++passes >= SLAB_REBALANCE_MAX_PASSES)) {
+				cursor = 0;
+				return;
+			}
+			page = NULL;
+		}
+	}
+}
+
+/* Call 'job' on the slots, starting from '*cursor', as long as the time
+ * spent is within 'budget' microseconds. Busy slots are skipped, and the
+ * cursor is left where the next call should start. */
+static void cronSlots(int *cursor, long long budget,
+		long long (*job)(memoryDb *db, long long us)) {
+	long long elapsed = 0;
+	int j;
+
+	for (j = 0; j < numslots && elapsed < budget; j++) {
+		memoryDb *db = slots[*cursor];
+
+		*cursor = (*cursor + 1) % numslots;
+		if (pthread_mutex_trylock(&db->lock) != 0)
+			continue;
+		zmalloc_set_thread_arena(db->arena);
+		elapsed += job(db, budget - elapsed);
+		unlockSlot(db);
+	}
+}
+
+/* Set the microseconds mdbCron() can spend rehashing at every call, 0 to
+ * leave the rehashing to the commands only. */
+void mdbSetRehashBudget(long long us) {
+	rehash_budget = us;
+}
+
+/* Limit the memory used to 'bytes', 0 for no limit. When the limit is
+ * reached writes evict keys according to 'policy':
+ *
+ * MDB_ALLKEYS_LRU: evict the least recently used keys.
+ * MDB_ALLKEYS_LFU: evict the least frequently used keys.
+ * MDB_VOLATILE_LRU: like allkeys-lru, only keys with a TTL.
+ * MDB_VOLATILE_LFU: like allkeys-lfu, only keys with a TTL.
+ * MDB_VOLATILE_TTL: evict the keys with the nearest expire time.
+ * MDB_NO_EVICTION: refuse the writes.
+ *
+ * Writes are refused as well when there is no key to evict. The policy
+ * should be set before adding keys: LRU and LFU store different data in
+ * the values. */
+void mdbSetMaxmemory(size_t bytes, int policy) {
+	maxmemory = bytes;
+	maxmemory_policy = policy;
+}
+
+/* Tune the LFU policies: the greater 'log_factor' the more accesses are
+ * needed to saturate the counters (with the default of 10, about a million
+ * accesses), and counters are decremented every 'decay_time' minutes the
+ * key is not accessed (0 to never decrement them). */
+void mdbSetLfuParams(int log_factor, int decay_time) {
+	lfu_log_factor = log_factor;
+	lfu_decay_time = decay_time;
+}
+
+/* Enable the TinyLFU admission filter, sized for a cache of about 'keys'
+ * keys, or disable it if 'keys' is 0. With the filter, when memory is full
+ * a new key is only stored if its reads were at least as frequent as the
+ * ones of the key it would evict, otherwise the write is refused. The
+ * frequency of keys is estimated from get() calls, misses included, with
+ * a count-min sketch of about 4 bytes per key.
+ *
+ * Like the other settings, it should not be changed while other threads
+ * are using the library. */
+void mdbSetAdmission(size_t keys) {
+	int j;
+
+	for (j = 0; j < numslots; j++) {
+		memoryDb *db = slots[j];
+
+		pthread_mutex_lock(&db->lock);
+		sketchFree(db->sketch);
+		db->sketch = keys ? sketchNew(keys / numslots) : NULL;
+		pthread_mutex_unlock(&db->lock);
+	}
+}
+
+/* Compress the values of at least 'min_len' bytes with LZ4, or disable
+ * compression if 'min_len' is 0, the default. Lengths below
+ * VALUE_COMPRESS_MIN_LEN are raised to it. Values are only stored
+ * compressed if that saves at least 1/VALUE_COMPRESS_MIN_SAVING of their
+ * size, and are decompressed by every read: getPinned() returns a copy, and
+ * append() and prepend() store them uncompressed. Values written before the
+ * call are left as they are. See the compress_* stats for the effect. */
+void mdbSetCompression(size_t min_len) {
+	int j;
+
+	if (min_len && min_len < VALUE_COMPRESS_MIN_LEN)
+		min_len = VALUE_COMPRESS_MIN_LEN;
+	for (j = 0; j < numslots; j++) {
+		memoryDb *db = slots[j];
+
+		pthread_mutex_lock(&db->lock);
+		db->compress_min_len = min_len;
+		pthread_mutex_unlock(&db->lock);
+	}
+}
+
+/* Set the microseconds mdbCron() can spend compacting the slab allocator at
+ * every call, 0 to only release the pages that become empty by themselves. */
+void mdbSetSlabsBudget(long long us) {
+	slabs_budget = us;
+}
+
+/* Set the growth factor of the chunk sizes of the slab allocator: the
+ * smaller the factor the less memory is wasted in every chunk, but the
+ * more classes there are. Must be called before initMdb(). */
+void mdbSetSlabFactor(double factor) {
+	slab_factor = factor;
+}
+
+/* Fill 'st' with the stats of at most 'max' slab classes, the first one
+ * accounting the allocations too big for a chunk. Returns the number of
+ * classes, 0 if MDB_SLABS is not used. */
+int mdbGetSlabStats(slabClassStats *st, int max) {
+	return slabsEnabled() ? slabsGetStats(st, max) : 0;
+}
+
+/* Fill 'st' with the memory of the arena of a slot. Returns false if the
+ * slot has no arena of its own, see MDB_ARENAS. */
+bool mdbGetSlotMemory(int slot, zmallocArenaStats *st) {
+	if (slot < 0 || slot >= numslots)
+		return false;
+	return zmalloc_arena_stats(slots[slot]->arena, st) == 0;
+}
+
+/* Set the microseconds mdbCron() can spend deleting expired keys at every
+ * call, 0 to only expire keys when they are accessed. */
+void mdbSetExpireBudget(long long us) {
+	expire_budget = us;
+}
+
+/* Background tasks the embedder should call periodically, for instance 10
+ * times per second, from a single thread.
+ *
+ * Commands only perform a rehash step for every lookup, so a big table may
+ * remain in the rehashing state for a long time, using the memory of both
+ * tables and probing both on misses. Here the rehashing of the slots is
+ * driven forward within the rehash budget.
+ *
+ * Similarly keys are expired when accessed, so keys with a TTL that are
+ * never accessed again would use memory forever: the active expire cycle
+ * deletes them within the expire budget.
+ *
+ * With MDB_SLABS the slab pages left mostly empty by a change of the value
+ * sizes are compacted within the slabs budget. */
+void mdbCron(void) {
+	static int rehash_cursor = 0, expire_cursor = 0;
+
+	updateCachedTime();
+	checkSnapshotChild();
+	cronSlots(&rehash_cursor, rehash_budget, rehashSlot);
+	cronSlots(&expire_cursor, expire_budget, expireSlot);
+	if (slabsEnabled() && slabs_budget)
+		slabsCron(slabs_budget);
+
+	/* Old tables and expired keys were retired by this thread: make sure
+	 * it frees them even if it does nothing else. */
+	if (numslots && slots[0]->flags & DB_CONCURRENT)
+		epochCollect();
+}
+
+/* Fill 'st' with the stats of the whole keyspace, summing the stats of
+ * every slot. */
+void mdbGetStats(stats_t *st) {
+	int j;
+
+	memset(st, 0, sizeof(*st));
+	for (j = 0; j < numslots; j++) {
+		memoryDb *db = slots[j];
+
+		pthread_mutex_lock(&db->lock);
+		st->numcommands += db->stats.numcommands;
+		st->expiredkeys += db->stats.expiredkeys;
+		st->expiredkeys_lazy += db->stats.expiredkeys_lazy;
+		st->expiredkeys_active += db->stats.expiredkeys_active;
+		st->expire_cycle_time += db->stats.expire_cycle_time;
+		st->evictedkeys += db->stats.evictedkeys;
+		st->eviction_time += db->stats.eviction_time;
+		st->rejected_writes += db->stats.rejected_writes;
+		st->admission_rejects += db->stats.admission_rejects;
+		st->keyspace_hits += db->stats.keyspace_hits;
+		st->keyspace_misses += db->stats.keyspace_misses;
+		st->cas_hits += db->stats.cas_hits;
+		st->cas_misses += db->stats.cas_misses;
+		st->cas_badval += db->stats.cas_badval;
+		st->rehash_steps += db->stats.rehash_steps;
+		st->rehash_time += db->stats.rehash_time;
+		if (dictIsRehashing(db->dict)) {
+			st->rehashing++;
+			st->rehash_pending += db->dict->ht[0].used;
+		}
+		pthread_mutex_unlock(&db->lock);
+	}
+	getCompressionStats(st);
+
+	pthread_mutex_lock(&snapshot_lock);
+	st->snapshots = snapshots;
+	st->snapshot_failures = snapshot_failures;
+	st->snapshot_in_progress = snapshot_child != -1;
+	st->snapshot_keys = last_snapshot.keys;
+	st->snapshot_bytes = last_snapshot.bytes;
+	st->snapshot_time = last_snapshot.time;
+	if (last_snapshot.time)
+		st->snapshot_throughput = last_snapshot.bytes * 1000000 /
+				last_snapshot.time;
+	st->snapshot_cow_bytes = last_snapshot.cow;
+	st->fork_time = fork_time;
+	pthread_mutex_unlock(&snapshot_lock);
+}
+
+#ifdef MDB_BENCHMARK_MAIN
+
+#define BENCHMARK_COUNTERS 10000
+
+static long benchmark_ops = 1000000; /* Operations per thread */
+static long benchmark_keys = 1000000;
+
+/* Every thread runs a mix of 90% get, 5% set and 5% incr against random
+ * keys. */
+static void *benchmarkThread(void *arg) {
+	unsigned int seed = (unsigned int) (long) arg;
+	char key[32];
+	long j;
+
+	for (j = 0; j < benchmark_ops; j++) {
+		int r = rand_r(&seed);
+		int op = r % 20;
+
+		if (op == 0) {
+			snprintf(key, sizeof(key), "counter:%d", r % BENCHMARK_COUNTERS);
+			incr(key);
+		} else {
+			snprintf(key, sizeof(key), "key:%ld", r % benchmark_keys);
+			if (op == 1)
+				set(key, "some value here", 0);
+			else
+				get(key);
+		}
+	}
+	mdbThreadOffline();
+	return NULL;
+}
+
+/* Lookups of random keys from a single thread, one at a time with get()
+ * and in batches with getMulti(), of existing keys then of missing ones.
+ * The key names are created in advance. */
+static void benchmarkGetMulti(void) {
+	static const int batches[] = {16, 32, 64};
+	static const char *kinds[] = {"key", "missing"};
+	char (*names)[32] = zmalloc(sizeof(*names) * benchmark_ops), label[32];
+	const char **keys = zmalloc(sizeof(char*) * benchmark_ops);
+	value_t *vals[64];
+	long long start, elapsed;
+	long j, found;
+	int i, k;
+
+	for (k = 0; k < 2; k++) {
+		for (j = 0; j < benchmark_ops; j++) {
+			snprintf(names[j], sizeof(names[j]), "%s:%ld", kinds[k],
+					random() % benchmark_keys);
+			keys[j] = names[j];
+		}
+		start = ustime();
+		for (found = 0, j = 0; j < benchmark_ops; j++)
+			found += get(keys[j]) != NULL;
+		elapsed = ustime() - start;
+		snprintf(label, sizeof(label), "get() %s:", k ? "miss" : "hit");
+		printf("%-19s %.0f keys/sec\n", label,
+				(double) benchmark_ops * 1000000 / elapsed);
+		for (i = 0; i < (int) (sizeof(batches) / sizeof(int)); i++) {
+			long n = benchmark_ops / batches[i] * batches[i];
+
+			start = ustime();
+			for (found = 0, j = 0; j < n; j += batches[i])
+				found += getMulti(keys + j, batches[i], vals);
+			elapsed = ustime() - start;
+			snprintf(label, sizeof(label), "getMulti(%d) %s:", batches[i],
+					k ? "miss" : "hit");
+			printf("%-19s %.0f keys/sec\n", label,
+					(double) n * 1000000 / elapsed);
+		}
+	}
+	mdbThreadOffline();
+	zfree(keys);
+	zfree(names);
+}
+
+/* Writes from a single thread: random existing keys overwritten with set()
+ * and setMulti(), then as many new keys loaded each way. */
+static void benchmarkSetMulti(void) {
+	static const int batches[] = {16, 64};
+	char (*names)[32] = zmalloc(sizeof(*names) * benchmark_ops);
+	const char **keys = zmalloc(sizeof(char*) * benchmark_ops);
+	const char **vals = zmalloc(sizeof(char*) * benchmark_ops);
+	long long start, elapsed;
+	long j;
+	int i;
+
+	for (j = 0; j < benchmark_ops; j++) {
+		snprintf(names[j], sizeof(names[j]), "key:%ld",
+				random() % benchmark_keys);
+		keys[j] = names[j];
+		vals[j] = "some other value";
+	}
+	start = ustime();
+	for (j = 0; j < benchmark_ops; j++)
+		set(keys[j], vals[j], 0);
+	elapsed = ustime() - start;
+	printf("set():           %.0f keys/sec\n",
+			(double) benchmark_ops * 1000000 / elapsed);
+	for (i = 0; i < (int) (sizeof(batches) / sizeof(int)); i++) {
+		long n = benchmark_ops / batches[i] * batches[i];
+
+		start = ustime();
+		for (j = 0; j < n; j += batches[i])
+			setMulti(keys + j, vals + j, NULL, batches[i]);
+		elapsed = ustime() - start;
+		printf("setMulti(%2d):    %.0f keys/sec\n", batches[i],
+				(double) n * 1000000 / elapsed);
+	}
+
+	for (j = 0; j < benchmark_ops; j++)
+		snprintf(names[j], sizeof(names[j]), "new:%ld", j);
+	start = ustime();
+	for (j = 0; j < benchmark_ops; j++)
+		set(keys[j], vals[j], 0);
+	elapsed = ustime() - start;
+	printf("set() new keys:  %.0f keys/sec\n",
+			(double) benchmark_ops * 1000000 / elapsed);
+	for (j = 0; j < benchmark_ops; j++)
+		snprintf(names[j], sizeof(names[j]), "bulk:%ld", j);
+	start = ustime();
+	setMulti(keys, vals, NULL, benchmark_ops);
+	elapsed = ustime() - start;
+	printf("setMulti() new:  %.0f keys/sec\n",
+			(double) benchmark_ops * 1000000 / elapsed);
+	mdbThreadOffline();
+	zfree(vals);
+	zfree(keys);
+	zfree(names);
+}
+
+/* Increments of a single counter, contended by all the threads, or of
+ * random counters out of BENCHMARK_COUNTERS. */
+static int benchmark_incr_keys;
+
+static void *benchmarkIncrThread(void *arg) {
+	unsigned int seed = (unsigned int) (long) arg;
+	char key[32];
+	long j;
+
+	for (j = 0; j < benchmark_ops; j++) {
+		snprintf(key, sizeof(key), "counter:%d",
+				rand_r(&seed) % benchmark_incr_keys);
+		incr(key);
+	}
+	mdbThreadOffline();
+	return NULL;
+}
+
+static void benchmarkIncr(const int *threads, int count) {
+	static const int keys[] = {1, BENCHMARK_COUNTERS};
+	int i, j, k;
+
+	for (k = 0; k < (int) (sizeof(keys) / sizeof(int)); k++) {
+		benchmark_incr_keys = keys[k];
+		for (i = 0; i < count; i++) {
+			pthread_t tid[16];
+			long long start = ustime(), elapsed;
+
+			for (j = 0; j < threads[i]; j++)
+				pthread_create(&tid[j], NULL, benchmarkIncrThread,
+						(void*) (long) j);
+			for (j = 0; j < threads[i]; j++)
+				pthread_join(tid[j], NULL);
+			elapsed = ustime() - start;
+			printf("incr() %5d key%s, %2d threads: %.0f ops/sec\n", keys[k],
+					keys[k] > 1 ? "s" : " ", threads[i],
+					(double) benchmark_ops * threads[i] * 1000000 / elapsed);
+		}
+	}
+}
+
+/* Values of BENCHMARK_APPEND_LEN bytes built from a single thread with
+ * appends, then with prepends, of 100 bytes. With MDB_ROPES neither copies
+ * the value built so far. */
+#define BENCHMARK_APPEND_LEN (1024*1024)
+
+static void benchmarkAppend(void) {
+	static const char *modes[] = {"append()", "prepend()"};
+	char piece[101];
+	long long start, elapsed;
+	long j, n = BENCHMARK_APPEND_LEN / 100;
+	int i;
+
+	memset(piece, 'x', 100);
+	piece[100] = '\0';
+	for (i = 0; i < 2; i++) {
+		delete("appended");
+		start = ustime();
+		for (j = 0; j < n; j++) {
+			if (i == 0)
+				append("appended", piece);
+			else
+				prepend("appended", piece);
+		}
+		elapsed = ustime() - start;
+		printf("%-10s to %d bytes: %.0f ops/sec\n", modes[i],
+				BENCHMARK_APPEND_LEN, (double) n * 1000000 / elapsed);
+	}
+	delete("appended");
+	mdbThreadOffline();
+}
+
+/* BENCHMARK_JSON_KEYS JSON documents of 2KB to 200KB, stored without and
+ * with compression: memory per key and single thread set() and getPinned()
+ * throughput. */
+#define BENCHMARK_JSON_KEYS 2000
+
+static sds benchmarkJson(size_t len) {
+	static const char *words[] = {"active", "pending", "admin", "guest",
+			"london", "paris", "tokyo", "premium", "basic", "disabled"};
+	sds s = sdsnew("[");
+
+	while (sdslen(s) < len) {
+		s = sdscatprintf(s, "{\"id\":%ld,\"user\":\"user%ld\","
+				"\"status\":\"%s\",\"city\":\"%s\",\"score\":%ld.%02ld,"
+				"\"tags\":[\"%s\",\"%s\"]},", random() % 1000000,
+				random() % 100000, words[random() % 10], words[random() % 10],
+				random() % 1000, random() % 100, words[random() % 10],
+				words[random() % 10]);
+	}
+	sdsrange(s, 0, len - 2);
+	return sdscat(s, "]");
+}
+
+static void benchmarkCompression(void) {
+	sds *docs = zmalloc(sizeof(sds) * BENCHMARK_JSON_KEYS);
+	long long start, set_time, get_time;
+	size_t used, total = 0;
+	char key[32];
+	int i, j;
+	stats_t st;
+
+	for (j = 0; j < BENCHMARK_JSON_KEYS; j++) {
+		docs[j] = benchmarkJson(2048 + random() % (200 * 1024 - 2048));
+		total += sdslen(docs[j]);
+	}
+	for (i = 0; i < 2; i++) {
+		mdbSetCompression(i ? VALUE_COMPRESS_MIN_LEN : 0);
+		used = zmalloc_used_memory();
+		start = ustime();
+		for (j = 0; j < BENCHMARK_JSON_KEYS; j++) {
+			snprintf(key, sizeof(key), "json:%d", j);
+			set(key, docs[j], 0);
+		}
+		set_time = ustime() - start;
+		used = zmalloc_used_memory() - used;
+		start = ustime();
+		for (j = 0; j < BENCHMARK_JSON_KEYS * 5; j++) {
+			mdbPinnedValue pv;
+
+			snprintf(key, sizeof(key), "json:%d", j % BENCHMARK_JSON_KEYS);
+			getPinned(key, &pv);
+			releasePinned(&pv);
+		}
+		get_time = ustime() - start;
+		printf("JSON %s: %zu bytes/key (values %zu), "
+				"%.0f set/sec, %.0f get/sec\n",
+				i ? "compressed  " : "uncompressed", used / BENCHMARK_JSON_KEYS,
+				total / BENCHMARK_JSON_KEYS,
+				(double) BENCHMARK_JSON_KEYS * 1000000 / set_time,
+				(double) BENCHMARK_JSON_KEYS * 5 * 1000000 / get_time);
+		for (j = 0; j < BENCHMARK_JSON_KEYS; j++) {
+			snprintf(key, sizeof(key), "json:%d", j);
+			delete(key);
+		}
+	}
+	mdbGetStats(&st);
+	printf("JSON compression ratio %.2f, %lld us compressing, "
+			"%lld us decompressing\n", (double) st.compress_bytes_in /
+			st.compress_bytes_out, st.compress_time, st.decompress_time);
+	mdbSetCompression(0);
+	for (j = 0; j < BENCHMARK_JSON_KEYS; j++)
+		sdsfree(docs[j]);
+	zfree(docs);
+	mdbThreadOffline();
+}
+
+/* save() and bgsave() of the keyspace built by main(), with a thread
+ * overwriting keys while bgsave() runs, then load() of the snapshot. */
+#define BENCHMARK_SNAPSHOT_FILE "mdb-benchmark.snap"
+
+static void benchmarkSnapshot(void) {
+	long long start, elapsed, writes = 0;
+	char key[32];
+	stats_t st;
+
+	if (!save(BENCHMARK_SNAPSHOT_FILE)) {
+		perror("save");
+		return;
+	}
+	mdbGetStats(&st);
+	printf("save(): %lld keys, %lld bytes in %lld us (%.0f MB/s)\n",
+			st.snapshot_keys, st.snapshot_bytes, st.snapshot_time,
+			(double) st.snapshot_throughput / (1024 * 1024));
+
+	start = ustime();
+	if (!bgsave(BENCHMARK_SNAPSHOT_FILE)) {
+		perror("bgsave");
+		return;
+	}
+	do {
+		snprintf(key, sizeof(key), "key:%ld", random() % benchmark_keys);
+		set(key, "some other value", 0);
+		if (++writes % 1000 == 0) {
+			mdbCron();
+			mdbGetStats(&st);
+		}
+	} while (writes % 1000 || st.snapshot_in_progress);
+	elapsed = ustime() - start;
+	printf("bgsave(): %lld bytes in %lld us (%.0f MB/s), fork %lld us, "
+			"%lld KB copied on write, %.0f set/sec meanwhile\n",
+			st.snapshot_bytes, st.snapshot_time,
+			(double) st.snapshot_throughput / (1024 * 1024), st.fork_time,
+			st.snapshot_cow_bytes / 1024, (double) writes * 1000000 / elapsed);
+
+	flush_all();
+	start = ustime();
+	if (!load(BENCHMARK_SNAPSHOT_FILE))
+		perror("load");
+	printf("load(): %lld us\n", ustime() - start);
+	unlink(BENCHMARK_SNAPSHOT_FILE);
+	mdbThreadOffline();
+}
+
+/* mdb-benchmark [slots] [ops per thread] [concurrent|ropes] [keys]
+ *               [chained|open] */
+int main(int argc, char **argv) {
+	int threads[] = {1, 2, 4, 8, 16};
+	int numSlots = 64, engine = DICT_ENGINE_CHAINED, flags = 0, j, i;
+	char key[32];
+
+	if (argc > 1) numSlots = atoi(argv[1]);
+	if (argc > 2) benchmark_ops = atol(argv[2]);
+	if (argc > 3 && !strcmp(argv[3], "concurrent")) flags |= MDB_CONCURRENT;
+	if (argc > 3 && !strcmp(argv[3], "ropes")) flags |= MDB_ROPES;
+	if (argc > 4) benchmark_keys = atol(argv[4]);
+	if (argc > 5 && !strcmp(argv[5], "open")) engine = DICT_ENGINE_OPEN;
+
+	initMdb(numSlots, engine, flags);
+	for (j = 0; j < benchmark_keys; j++) {
+		snprintf(key, sizeof(key), "key:%d", j);
+		set(key, "some value here", 0);
+	}
+	for (j = 0; j < BENCHMARK_COUNTERS; j++) {
+		snprintf(key, sizeof(key), "counter:%d", j);
+		set(key, "0", 0);
+	}
+
+	printf("%d slots%s, %s dicts, %ld ops per thread "
+			"(90%% get, 5%% set, 5%% incr)\n", numSlots,
+			flags & MDB_CONCURRENT ? " (lock-free get)" : "",
+			engine == DICT_ENGINE_OPEN ? "open addressing" : "chained",
+			benchmark_ops);
+	for (i = 0; i < (int) (sizeof(threads) / sizeof(int)); i++) {
+		pthread_t tid[16];
+		long long start = ustime(), elapsed;
+
+		for (j = 0; j < threads[i]; j++)
+			pthread_create(&tid[j], NULL, benchmarkThread, (void*) (long) j);
+		for (j = 0; j < threads[i]; j++)
+			pthread_join(tid[j], NULL);
+		elapsed = ustime() - start;
+		printf("%2d threads: %.0f ops/sec\n", threads[i],
+				(double) benchmark_ops * threads[i] * 1000000 / elapsed);
+	}
+	benchmarkIncr(threads, sizeof(threads) / sizeof(int));
+	benchmarkGetMulti();
+	benchmarkSetMulti();
+	benchmarkAppend();
+	benchmarkCompression();
+	benchmarkSnapshot();
+	return 0;
 }
+#endif
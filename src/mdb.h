@@ -7,4 +7,86 @@
 #include "sds.h"
 #include "db.h"
 
+/* initMdb() flags */
+#define MDB_CONCURRENT DB_CONCURRENT /* Lock-free get() */
+#define MDB_PRECISE_CLOCK (1<<16) /* Read the time at every TTL check */
+#define MDB_SLABS (1<<17) /* Store the keys in a slab allocator */
+#define MDB_ARENAS DB_ARENAS /* An allocator arena per slot (jemalloc only) */
+#define MDB_ROPES DB_ROPES /* Cheap append() and prepend() to large values */
+
+#define MDB_CLOCK_RESOLUTION 1 /* milliseconds between cached clock updates */
+
+#define MDB_DEFAULT_REHASH_BUDGET 1000 /* microseconds per mdbCron() call */
+#define MDB_DEFAULT_EXPIRE_BUDGET 1000 /* microseconds per mdbCron() call */
+#define MDB_DEFAULT_SLABS_BUDGET 1000 /* microseconds per mdbCron() call */
+
+#define SLAB_REBALANCE_BATCH 256 /* Chunks visited with all the slots locked */
+#define SLAB_REBALANCE_MAX_PASSES 10 /* Waits for a page to be freed */
+
+/* Eviction policies for mdbSetMaxmemory() */
+#define MDB_ALLKEYS_LRU MAXMEMORY_ALLKEYS_LRU
+#define MDB_ALLKEYS_LFU MAXMEMORY_ALLKEYS_LFU
+#define MDB_VOLATILE_LRU MAXMEMORY_VOLATILE_LRU
+#define MDB_VOLATILE_LFU MAXMEMORY_VOLATILE_LFU
+#define MDB_VOLATILE_TTL MAXMEMORY_VOLATILE_TTL
+#define MDB_NO_EVICTION MAXMEMORY_NO_EVICTION
+
+#define MAXMEMORY_EVICTION_MAX_KEYS 16 /* Keys evicted at most per write */
+
+#define MDB_GET_BATCH 16 /* Keys looked up together by getMulti() */
+#define MDB_SET_BATCH 16 /* Keys written together by setMulti() */
+
+/* cas() results */
+#define MDB_CAS_OK DB_CAS_STORED
+#define MDB_CAS_EXISTS DB_CAS_EXISTS /* Written since the CAS id was read */
+#define MDB_CAS_NOT_FOUND DB_CAS_NOT_FOUND
+#define MDB_CAS_NOT_STORED 3 /* Refused because of maxmemory */
+
+/* A value pinned by getPinned(), valid until releasePinned(). */
+typedef struct mdbPinnedValue {
+	const char *ptr; /* The bytes of the value */
+	size_t len;
+	uint64_t cas; /* CAS id of the value, see cas() */
+	uint64_t pin; /* Epoch pin, 0 if the value was copied in 'buf' */
+	sds copy; /* Decompressed value, freed by releasePinned() */
+	char buf[VALUE_STR_BUF_SIZE];
+} mdbPinnedValue;
+
+bool initMdb(int numSlots, int engine, int flags);
+value_t *get(const char *k);
+value_t *getWithCas(const char *k, uint64_t *cas);
+size_t getMulti(const char **keys, size_t count, value_t **vals);
+bool getPinned(const char *k, mdbPinnedValue *pv);
+int getPinnedIov(const char *k, mdbPinnedValue *pv, struct iovec *iov,
+		int max);
+void releasePinned(mdbPinnedValue *pv);
+void mdbThreadOffline(void);
+bool set(const char *k, const char *v, long expire);
+size_t setMulti(const char **keys, const char **vals, const long *expires,
+		size_t count);
+bool add(const char *k, const char *v, long expire);
+bool replace(const char *k, const char *v, long expire);
+size_t append(const char *k, const char *suffix);
+size_t prepend(const char *k, const char *prefix);
+bool delete(const char *k);
+int cas(const char *k, const char *v, long expire, uint64_t casid);
+bool incr(const char *k);
+bool decr(const char *k);
+void flush_all();
+bool save(const char *filename);
+bool bgsave(const char *filename);
+bool load(const char *filename);
+void mdbCron(void);
+void mdbSetRehashBudget(long long us);
+void mdbSetExpireBudget(long long us);
+void mdbSetSlabsBudget(long long us);
+void mdbSetSlabFactor(double factor);
+int mdbGetSlabStats(slabClassStats *st, int max);
+bool mdbGetSlotMemory(int slot, zmallocArenaStats *st);
+void mdbSetMaxmemory(size_t bytes, int policy);
+void mdbSetLfuParams(int log_factor, int decay_time);
+void mdbSetAdmission(size_t keys);
+void mdbSetCompression(size_t min_len);
+void mdbGetStats(stats_t *st);
+
 #endif
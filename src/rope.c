@@ -0,0 +1,142 @@
+/* Ropes, see rope.h.
+ *
+ * Segments are singly linked from the head to the tail. The bytes of a
+ * segment are data[start..end): segments added by ropeAppend() are filled
+ * from the start of data[], the ones added by ropePrepend() from its end,
+ * so that both ends of the rope keep room to grow in place. */
+
+#include "fmacros.h"
+
+#include <string.h>
+
+#include "rope.h"
+#include "zmalloc.h"
+
+static ropeSegment *ropeSegmentNew(void) {
+	ropeSegment *seg = zmalloc(ROPE_SEGMENT_SIZE);
+
+	seg->next = NULL;
+	seg->start = seg->end = 0;
+	return seg;
+}
+
+/* Create a rope with a copy of the 'len' bytes at 's'. */
+rope *ropeNew(const char *s, size_t len) {
+	rope *r = zmalloc(sizeof(*r));
+
+	r->len = 0;
+	r->segments = 0;
+	r->head = r->tail = NULL;
+	ropeAppend(r, s, len);
+	return r;
+}
+
+void ropeFree(rope *r) {
+	ropeSegment *seg = r->head, *next;
+
+	while (seg) {
+		next = seg->next;
+		zfree(seg);
+		seg = next;
+	}
+	zfree(r);
+}
+
+/* Append 'len' bytes to the rope, filling the free space at the end of the
+ * tail segment first. */
+void ropeAppend(rope *r, const char *s, size_t len) {
+	ropeSegment *seg;
+	size_t n;
+
+	r->len += len;
+	if (r->tail) {
+		n = ROPE_SEGMENT_DATA - r->tail->end;
+		if (n > len)
+			n = len;
+		memcpy(r->tail->data + r->tail->end, s, n);
+		r->tail->end += n;
+		s += n;
+		len -= n;
+	}
+	while (len) {
+		n = len < ROPE_SEGMENT_DATA ? len : ROPE_SEGMENT_DATA;
+		seg = ropeSegmentNew();
+		memcpy(seg->data, s, n);
+		seg->end = n;
+		if (r->tail)
+			r->tail->next = seg;
+		else
+			r->head = seg;
+		r->tail = seg;
+		r->segments++;
+		s += n;
+		len -= n;
+	}
+}
+
+/* Prepend 'len' bytes to the rope, filling the free space at the start of
+ * the head segment first. The bytes are copied from the last ones, as the
+ * segments are linked from the end of the new content. */
+void ropePrepend(rope *r, const char *s, size_t len) {
+	ropeSegment *seg;
+	size_t n;
+
+	r->len += len;
+	if (r->head) {
+		n = r->head->start;
+		if (n > len)
+			n = len;
+		r->head->start -= n;
+		memcpy(r->head->data + r->head->start, s + len - n, n);
+		len -= n;
+	}
+	while (len) {
+		n = len < ROPE_SEGMENT_DATA ? len : ROPE_SEGMENT_DATA;
+		seg = ropeSegmentNew();
+		seg->start = ROPE_SEGMENT_DATA - n;
+		seg->end = ROPE_SEGMENT_DATA;
+		memcpy(seg->data + seg->start, s + len - n, n);
+		seg->next = r->head;
+		r->head = seg;
+		if (r->tail == NULL)
+			r->tail = seg;
+		r->segments++;
+		len -= n;
+	}
+}
+
+/* Copy the r->len bytes of the rope to 'dst'. */
+void ropeCopy(rope *r, char *dst) {
+	ropeSegment *seg;
+
+	for (seg = r->head; seg; seg = seg->next) {
+		memcpy(dst, seg->data + seg->start, seg->end - seg->start);
+		dst += seg->end - seg->start;
+	}
+}
+
+/* Set an iovec for every segment of the rope, for writev(). Returns the
+ * number of iovecs set, or -1, setting none, if the rope has more than
+ * 'max' segments. */
+int ropeIovec(rope *r, struct iovec *iov, int max) {
+	ropeSegment *seg;
+	int j = 0;
+
+	if (r->segments > (unsigned long) max)
+		return -1;
+	for (seg = r->head; seg; seg = seg->next) {
+		iov[j].iov_base = seg->data + seg->start;
+		iov[j].iov_len = seg->end - seg->start;
+		j++;
+	}
+	return j;
+}
+
+/* Bytes allocated for the rope. All the segments have the same size. */
+size_t ropeAllocSize(rope *r) {
+	size_t size = zmalloc_size(r);
+
+	if (r->head)
+		size += r->segments * zmalloc_size(r->head);
+	return size;
+}
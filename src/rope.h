@@ -0,0 +1,45 @@
+/* Ropes: strings stored as a list of fixed-size segments.
+ *
+ * Appending to an sds string may realloc() it, copying the whole string,
+ * and prepending always copies it, so building a large value with many
+ * small appends or prepends is quadratic. A rope only writes the new bytes:
+ * the first and the last segments keep free space at their start and at
+ * their end, and new segments are linked when it is used up. Both appends
+ * and prepends cost O(bytes added + ROPE_SEGMENT_SIZE).
+ *
+ * The content of a rope is not contiguous: it can be written to a socket
+ * with writev() (see ropeIovec()) or copied out with ropeCopy(). */
+
+#ifndef __ROPE_H
+#define __ROPE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define ROPE_SEGMENT_SIZE 4096 /* Allocation size of a segment */
+
+typedef struct ropeSegment {
+	struct ropeSegment *next;
+	uint32_t start; /* Offset of the first byte used in data[] */
+	uint32_t end; /* Offset past the last byte used in data[] */
+	char data[];
+} ropeSegment;
+
+#define ROPE_SEGMENT_DATA (ROPE_SEGMENT_SIZE - offsetof(ropeSegment, data))
+
+typedef struct rope {
+	size_t len;
+	unsigned long segments;
+	ropeSegment *head, *tail;
+} rope;
+
+rope *ropeNew(const char *s, size_t len);
+void ropeFree(rope *r);
+void ropeAppend(rope *r, const char *s, size_t len);
+void ropePrepend(rope *r, const char *s, size_t len);
+void ropeCopy(rope *r, char *dst);
+int ropeIovec(rope *r, struct iovec *iov, int max);
+size_t ropeAllocSize(rope *r);
+
+#endif /* __ROPE_H */
@@ -0,0 +1,340 @@
+/* Slab allocator, see slabs.h.
+ *
+ * Pages are aligned to SLAB_PAGE_SIZE, so the page of a chunk, and the
+ * class of the chunk stored in the page header, are found just masking
+ * its address.
+ *
+ * Chunks are carved from a page only when needed, so a new page doesn't
+ * use physical memory it doesn't need yet. Freed chunks are kept in a free
+ * list per page, and the pages with free chunks are in a list per class.
+ * A bitmap in the page header tells the chunks in use, for compaction.
+ *
+ * Every class has its own lock. Pages are allocated with zmalloc_aligned(),
+ * so they are accounted in zmalloc_used_memory() as a whole. */
+
+#include "fmacros.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "slabs.h"
+#include "zmalloc.h"
+
+#define SLAB_BITMAP_SIZE (SLAB_PAGE_SIZE / SLAB_MIN_CHUNK / 8)
+
+struct slabPage {
+	int clsid; /* Class of the chunks */
+	int frozen; /* Being compacted: no chunk is allocated from it */
+	unsigned long used; /* Chunks in use */
+	unsigned long carved; /* Chunks allocated at least once */
+	void *freelist; /* Free chunks, not kept if frozen */
+	struct slabPage *prev, *next; /* Pages of the class with free chunks */
+	unsigned char bitmap[SLAB_BITMAP_SIZE]; /* Chunks in use */
+};
+
+/* Chunks start after the header, at a cache line boundary. */
+#define SLAB_HEADER_SIZE ((sizeof(slabPage) + 63) & ~(size_t) 63)
+
+typedef struct slabClass {
+	pthread_mutex_t lock;
+	size_t size; /* Chunk size */
+	unsigned long perslab; /* Chunks per page */
+	slabPage *partial; /* Pages with free chunks, not frozen */
+	unsigned long pages;
+	unsigned long used; /* Chunks in use */
+	unsigned long long allocs, frees, pages_released;
+} slabClass;
+
+/* Class 0 is unused, slabsClsid() returns it for sizes not served. */
+static slabClass classes[SLAB_MAX_CLASSES];
+static int numclasses = 0;
+static int rebalance_cursor = 1;
+
+/* Create the classes with sizes growing by 'factor', up to SLAB_CHUNK_MAX.
+ * It must be called before allocating, and only once. */
+void slabsInit(double factor) {
+	size_t size = SLAB_MIN_CHUNK;
+	int j;
+
+	if (factor <= 1)
+		factor = SLAB_DEFAULT_FACTOR;
+	memset(classes, 0, sizeof(classes));
+	numclasses = 1;
+	while (size < SLAB_CHUNK_MAX && numclasses < SLAB_MAX_CLASSES-1) {
+		size_t next = ((size_t) (size * factor) + 7) & ~(size_t) 7;
+
+		classes[numclasses++].size = size;
+		size = next > size ? next : size + 8;
+	}
+	classes[numclasses++].size = SLAB_CHUNK_MAX;
+	for (j = 0; j < numclasses; j++) {
+		pthread_mutex_init(&classes[j].lock, NULL);
+		if (j)
+			classes[j].perslab = (SLAB_PAGE_SIZE - SLAB_HEADER_SIZE)
+					/ classes[j].size;
+	}
+}
+
+int slabsEnabled(void) {
+	return numclasses != 0;
+}
+
+/* Return the class of the chunks big enough for 'size' bytes, or 0. */
+static int slabsClsid(size_t size) {
+	int lo = 1, hi = numclasses - 1;
+
+	if (size > SLAB_CHUNK_MAX)
+		return 0;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (classes[mid].size < size)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static slabPage *pageOf(void *ptr) {
+	return (slabPage*) ((uintptr_t) ptr & ~(uintptr_t) (SLAB_PAGE_SIZE-1));
+}
+
+static char *pageChunk(slabPage *page, unsigned long idx) {
+	return (char*) page + SLAB_HEADER_SIZE + idx * classes[page->clsid].size;
+}
+
+static unsigned long chunkIndex(slabPage *page, void *ptr) {
+	return ((char*) ptr - (char*) page - SLAB_HEADER_SIZE)
+			/ classes[page->clsid].size;
+}
+
+static void partialLink(slabClass *c, slabPage *page) {
+	page->prev = NULL;
+	page->next = c->partial;
+	if (c->partial)
+		c->partial->prev = page;
+	c->partial = page;
+}
+
+static void partialUnlink(slabClass *c, slabPage *page) {
+	if (page->prev)
+		page->prev->next = page->next;
+	else
+		c->partial = page->next;
+	if (page->next)
+		page->next->prev = page->prev;
+	page->prev = page->next = NULL;
+}
+
+static int pageIsFull(slabClass *c, slabPage *page) {
+	return page->freelist == NULL && page->carved == c->perslab;
+}
+
+static void pageRelease(slabClass *c, slabPage *page) {
+	c->pages--;
+	zfree_aligned(page, SLAB_PAGE_SIZE);
+}
+
+/* Allocate a chunk of at least 'size' bytes. Returns NULL if 'size' is
+ * larger than SLAB_CHUNK_MAX. */
+void *slabsAlloc(size_t size) {
+	int id = slabsClsid(size);
+	slabClass *c = &classes[id];
+	slabPage *page;
+	unsigned long idx;
+	void *ptr;
+
+	if (id == 0)
+		return NULL;
+	pthread_mutex_lock(&c->lock);
+	page = c->partial;
+	if (page == NULL) {
+		page = zmalloc_aligned(SLAB_PAGE_SIZE, SLAB_PAGE_SIZE);
+		memset(page, 0, sizeof(*page));
+		page->clsid = id;
+		partialLink(c, page);
+		c->pages++;
+	}
+	if (page->freelist) {
+		ptr = page->freelist;
+		page->freelist = *(void**) ptr;
+		idx = chunkIndex(page, ptr);
+	} else {
+		idx = page->carved++;
+		ptr = pageChunk(page, idx);
+	}
+	page->bitmap[idx / 8] |= 1 << (idx % 8);
+	page->used++;
+	if (pageIsFull(c, page))
+		partialUnlink(c, page);
+	c->used++;
+	c->allocs++;
+	pthread_mutex_unlock(&c->lock);
+	return ptr;
+}
+
+void slabsFree(void *ptr) {
+	slabPage *page = pageOf(ptr);
+	slabClass *c = &classes[page->clsid];
+	unsigned long idx;
+
+	pthread_mutex_lock(&c->lock);
+	idx = chunkIndex(page, ptr);
+	page->bitmap[idx / 8] &= ~(1 << (idx % 8));
+	page->used--;
+	c->used--;
+	c->frees++;
+	if (!page->frozen) {
+		if (pageIsFull(c, page))
+			partialLink(c, page);
+		*(void**) ptr = page->freelist;
+		page->freelist = ptr;
+
+		/* Release empty pages, unless the other pages have too few free
+		 * chunks: we would need a new page soon. */
+		if (page->used == 0
+				&& c->pages * c->perslab - c->used >= 2 * c->perslab) {
+			partialUnlink(c, page);
+			pageRelease(c, page);
+		}
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+/* Return the bytes usable by an allocation of 'size' bytes, 'size' itself
+ * if it is not served by the slabs. */
+size_t slabsChunkSize(size_t size) {
+	int id = slabsClsid(size);
+
+	return id ? classes[id].size : size;
+}
+
+/* Return the bytes that can actually be used at 'ptr', a chunk returned by
+ * slabsAlloc(). */
+size_t slabsUsableSize(void *ptr) {
+	return classes[pageOf(ptr)->clsid].size;
+}
+
+/* Fill 'st' with the stats of at most 'max' classes, by chunk size.
+ * Returns the number of classes filled. */
+int slabsGetStats(slabClassStats *st, int max) {
+	int j, n;
+
+	for (n = 0, j = 1; j < numclasses && n < max; j++, n++) {
+		slabClass *c = &classes[j];
+
+		pthread_mutex_lock(&c->lock);
+		st[n].size = c->size;
+		st[n].perslab = c->perslab;
+		st[n].pages = c->pages;
+		st[n].used_chunks = c->used;
+		st[n].free_chunks = c->pages * c->perslab - c->used;
+		st[n].allocs = c->allocs;
+		st[n].frees = c->frees;
+		st[n].pages_released = c->pages_released;
+		pthread_mutex_unlock(&c->lock);
+	}
+	return n;
+}
+
+/*-----------------------------------------------------------------------------
+ * Compaction
+ *
+ * When the sizes of the values shift, the classes of the old sizes are left
+ * with many free chunks spread over pages that still have some items, so
+ * they can't be released. The caller compacts a page as follows:
+ *
+ * 1) slabsRebalanceStart() picks the page with fewer items in the class with
+ *    more free chunks, and freezes it: no chunk will be allocated from it.
+ * 2) The chunks still used are visited with slabsPageNextUsed(), and the
+ *    owner of every item moves it to a new allocation and frees the old
+ *    one. The class has at least one page of free chunks in other pages,
+ *    so no new page is needed for that.
+ * 3) slabsRebalanceEnd() releases the page once all its chunks are free.
+ *
+ * Chunks of a frozen page are not reused once freed, so the caller can
+ * safely inspect a chunk just freed by another thread.
+ *----------------------------------------------------------------------------*/
+
+/* Return a frozen page to compact, or NULL if no class needs it. */
+slabPage *slabsRebalanceStart(void) {
+	int j;
+
+	for (j = 1; j < numclasses; j++) {
+		int id = rebalance_cursor;
+		slabClass *c = &classes[id];
+		slabPage *page, *best = NULL;
+
+		rebalance_cursor = rebalance_cursor % (numclasses - 1) + 1;
+		pthread_mutex_lock(&c->lock);
+		if (c->pages * c->perslab - c->used
+				>= SLAB_REBALANCE_FREE_PAGES * c->perslab) {
+			for (page = c->partial; page; page = page->next) {
+				if (best == NULL || page->used < best->used)
+					best = page;
+			}
+		}
+		if (best) {
+			partialUnlink(c, best);
+			best->frozen = 1;
+			best->freelist = NULL;
+		}
+		pthread_mutex_unlock(&c->lock);
+		if (best)
+			return best;
+	}
+	return NULL;
+}
+
+/* Return the first chunk in use of the frozen page starting from the index
+ * '*cursor', updating the cursor, or NULL if there are no more. */
+void *slabsPageNextUsed(slabPage *page, unsigned long *cursor) {
+	slabClass *c = &classes[page->clsid];
+	void *ptr = NULL;
+	unsigned long idx;
+
+	pthread_mutex_lock(&c->lock);
+	for (idx = *cursor; idx < page->carved; idx++) {
+		if (page->bitmap[idx / 8] & (1 << (idx % 8))) {
+			ptr = pageChunk(page, idx);
+			idx++;
+			break;
+		}
+	}
+	*cursor = idx;
+	pthread_mutex_unlock(&c->lock);
+	return ptr;
+}
+
+/* Release the frozen page if all its chunks are free, or if 'giveup' is
+ * true stop compacting it, making its free chunks available again. Returns
+ * 0 if the page is still frozen. */
+int slabsRebalanceEnd(slabPage *page, int giveup) {
+	slabClass *c = &classes[page->clsid];
+	unsigned long idx;
+
+	pthread_mutex_lock(&c->lock);
+	if (page->used == 0) {
+		c->pages_released++;
+		pageRelease(c, page);
+	} else if (giveup) {
+		page->frozen = 0;
+		for (idx = 0; idx < page->carved; idx++) {
+			if (!(page->bitmap[idx / 8] & (1 << (idx % 8)))) {
+				void *ptr = pageChunk(page, idx);
+
+				*(void**) ptr = page->freelist;
+				page->freelist = ptr;
+			}
+		}
+		if (!pageIsFull(c, page))
+			partialLink(c, page);
+	} else {
+		pthread_mutex_unlock(&c->lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&c->lock);
+	return 1;
+}
@@ -0,0 +1,57 @@
+/* Slab allocator for items.
+ *
+ * Memory is allocated in pages of SLAB_PAGE_SIZE bytes, each one split in
+ * chunks of the same size. Chunk sizes grow by a configurable factor from
+ * one class to the next, and an allocation is served by the smallest class
+ * that fits it. Allocations larger than SLAB_CHUNK_MAX are not served: the
+ * caller allocates them with zmalloc(), and must tell them apart when they
+ * are freed. Pages are aligned to SLAB_PAGE_SIZE, so serving them here would
+ * waste most of the alignment.
+ *
+ * A general purpose allocator fragments when the sizes of the values change
+ * over time: the memory freed by small values can't be reused by big ones.
+ * Here pages whose class has many free chunks can be compacted: their items
+ * are moved to other pages of the class (see slabsRebalanceStart()) and the
+ * page is released, so it can be used by any other class. */
+
+#ifndef __SLABS_H
+#define __SLABS_H
+
+#include <stddef.h>
+
+#define SLAB_PAGE_SIZE (1024*1024)
+#define SLAB_CHUNK_MAX (SLAB_PAGE_SIZE/2) /* Largest chunk size */
+#define SLAB_MIN_CHUNK 64 /* Smallest chunk size */
+#define SLAB_DEFAULT_FACTOR 1.25 /* Chunk size growth factor */
+#define SLAB_MAX_CLASSES 64
+
+/* Pages are compacted in classes with at least this many pages of free
+ * chunks. */
+#define SLAB_REBALANCE_FREE_PAGES 2
+
+typedef struct slabClassStats {
+	size_t size; /* Chunk size */
+	unsigned long perslab; /* Chunks per page */
+	unsigned long pages; /* Pages allocated */
+	unsigned long used_chunks;
+	unsigned long free_chunks;
+	unsigned long long allocs;
+	unsigned long long frees;
+	unsigned long long pages_released; /* Pages compacted and released */
+} slabClassStats;
+
+typedef struct slabPage slabPage;
+
+void slabsInit(double factor);
+int slabsEnabled(void);
+void *slabsAlloc(size_t size);
+void slabsFree(void *ptr);
+size_t slabsChunkSize(size_t size);
+size_t slabsUsableSize(void *ptr);
+int slabsGetStats(slabClassStats *st, int max);
+
+slabPage *slabsRebalanceStart(void);
+void *slabsPageNextUsed(slabPage *page, unsigned long *cursor);
+int slabsRebalanceEnd(slabPage *page, int giveup);
+
+#endif /* __SLABS_H */
@@ -1,15 +1,46 @@
 #ifndef _STATS_H
 #define _STATS_H
+
+#include <time.h>
+
 typedef struct {
 	/* Fields used only for stats */
 	time_t starttime; /* Server start time */
 	long long numcommands; /* Number of processed commands */
 	long long expiredkeys; /* Number of expired keys */
+	long long expiredkeys_lazy; /* Expired keys deleted when accessed */
+	long long expiredkeys_active; /* Expired keys deleted by mdbCron() */
+	long long expire_cycle_time; /* Microseconds spent in expire cycles */
 	long long evictedkeys; /* Number of evicted keys (maxmemory) */
+	long long eviction_time; /* Microseconds spent evicting keys */
+	long long rejected_writes; /* Writes refused because of maxmemory */
+	long long admission_rejects; /* Of which refused by the admission filter */
 	long long keyspace_hits; /* Number of successful lookups of keys */
 	long long keyspace_misses; /* Number of failed lookups of keys */
+	long long cas_hits; /* cas() writes performed */
+	long long cas_misses; /* cas() of keys not found */
+	long long cas_badval; /* cas() refused since the key was written */
+	long long compressed_values; /* Values stored compressed */
+	long long compress_skipped; /* Values that didn't compress enough */
+	long long compress_bytes_in; /* Bytes of the values compressed */
+	long long compress_bytes_out; /* Bytes they were compressed to */
+	long long compress_time; /* Microseconds spent compressing */
+	long long decompressions; /* Values decompressed to be read */
+	long long decompress_time; /* Microseconds spent decompressing */
+	long long snapshots; /* Snapshots written by save() and bgsave() */
+	long long snapshot_failures; /* Snapshots that could not be written */
+	long long snapshot_in_progress; /* 1 while bgsave() runs */
+	long long snapshot_keys; /* Keys in the last snapshot */
+	long long snapshot_bytes; /* Size of the last snapshot */
+	long long snapshot_time; /* Microseconds spent writing it */
+	long long snapshot_throughput; /* Bytes per second it was written at */
+	long long snapshot_cow_bytes; /* Memory copied on write during bgsave() */
+	long long fork_time; /* Microseconds the last bgsave() fork() took */
+	long long rehash_steps; /* Rehash steps performed by mdbCron() */
+	long long rehash_time; /* Microseconds spent rehashing in mdbCron() */
+	long long rehashing; /* Dicts being rehashed, only set by mdbGetStats() */
+	long long rehash_pending; /* Keys left in the old tables of those dicts */
 	size_t peak_memory; /* Max used memory record */
 } stats_t;
 
-extern stats_t stats;
 #endif
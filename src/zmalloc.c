@@ -28,6 +28,8 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "fmacros.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -39,8 +41,12 @@ void zlibc_free(void *ptr) {
     free(ptr);
 }
 
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <pthread.h>
+#include <sys/types.h>
 #include "config.h"
 #include "zmalloc.h"
 
@@ -60,11 +66,20 @@ void zlibc_free(void *ptr) {
 #define calloc(count,size) tc_calloc(count,size)
 #define realloc(ptr,size) tc_realloc(ptr,size)
 #define free(ptr) tc_free(ptr)
+#define posix_memalign(ptr,alignment,size) tc_posix_memalign(ptr,alignment,size)
 #elif defined(USE_JEMALLOC)
-#define malloc(size) je_malloc(size)
-#define calloc(count,size) je_calloc(count,size)
-#define realloc(ptr,size) je_realloc(ptr,size)
-#define free(ptr) je_free(ptr)
+/* Allocations go to the arena of the thread if any, see
+ * zmalloc_set_thread_arena(). Frees with the arena bypass the thread cache
+ * only for the memory of that arena, so it is not handed to other arenas:
+ * memory freed with another arena selected, or none, goes to the thread
+ * cache like any other. */
+static __thread int thread_arena = ZMALLOC_NO_ARENA;
+#define arena_flags() (thread_arena == ZMALLOC_NO_ARENA ? 0 : MALLOCX_ARENA(thread_arena))
+#define malloc(size) je_mallocx(size,arena_flags())
+#define calloc(count,size) je_mallocx((count)*(size),arena_flags()|MALLOCX_ZERO)
+#define realloc(ptr,size) je_rallocx(ptr,size,arena_flags())
+#define free(ptr) je_dallocx(ptr,arena_flags())
+#define posix_memalign(ptr,alignment,size) je_posix_memalign(ptr,alignment,size)
 #endif
 
 #if defined(__ATOMIC_RELAXED)
@@ -88,11 +103,20 @@ void zlibc_free(void *ptr) {
 
 #endif
 
+/* Once thread safety is enabled every thread accounts its allocations in a
+ * thread local counter, folded into used_memory only when it exceeds
+ * zmalloc_stat_batch bytes in either direction, so that threads allocating
+ * at the same time don't contend for the cache line of used_memory. The
+ * total read by zmalloc_used_memory() is exact for the calling thread, and
+ * within zmalloc_stat_batch bytes per thread for the others. */
 #define update_zmalloc_stat_alloc(__n) do { \
     size_t _n = (__n); \
     if (_n&(sizeof(long)-1)) _n += sizeof(long)-(_n&(sizeof(long)-1)); \
     if (zmalloc_thread_safe) { \
-        update_zmalloc_stat_add(_n); \
+        if (!thread_used_memory_registered) zmalloc_thread_register(); \
+        thread_used_memory += _n; \
+        if (thread_used_memory > (long long)zmalloc_stat_batch) \
+            zmalloc_thread_flush(); \
     } else { \
         used_memory += _n; \
     } \
@@ -102,7 +126,10 @@ void zlibc_free(void *ptr) {
     size_t _n = (__n); \
     if (_n&(sizeof(long)-1)) _n += sizeof(long)-(_n&(sizeof(long)-1)); \
     if (zmalloc_thread_safe) { \
-        update_zmalloc_stat_sub(_n); \
+        if (!thread_used_memory_registered) zmalloc_thread_register(); \
+        thread_used_memory -= _n; \
+        if (thread_used_memory < -(long long)zmalloc_stat_batch) \
+            zmalloc_thread_flush(); \
     } else { \
         used_memory -= _n; \
     } \
@@ -110,8 +137,53 @@ void zlibc_free(void *ptr) {
 
 static size_t used_memory = 0;
 static int zmalloc_thread_safe = 0;
+static size_t zmalloc_stat_batch = ZMALLOC_STAT_BATCH;
 pthread_mutex_t used_memory_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/* Bytes allocated (or freed, if negative) by this thread and not yet added
+ * to used_memory. */
+static __thread long long thread_used_memory = 0;
+static __thread int thread_used_memory_registered = 0;
+static pthread_key_t thread_used_memory_key;
+static pthread_once_t thread_used_memory_once = PTHREAD_ONCE_INIT;
+static long zmalloc_threads = 0; /* Threads that may hold a counter */
+
+static void zmalloc_thread_exit(void *arg) {
+    ((void) arg);
+    zmalloc_thread_flush();
+    /* Allocations made after this, by the destructors of other keys, get
+     * the thread registered again. */
+    thread_used_memory_registered = 0;
+    __atomic_sub_fetch(&zmalloc_threads,1,__ATOMIC_RELAXED);
+}
+
+static void zmalloc_thread_key_create(void) {
+    pthread_key_create(&thread_used_memory_key,zmalloc_thread_exit);
+}
+
+/* Called at the first counter update of a thread, so that the counter is
+ * flushed when the thread exits whatever its value. */
+static void zmalloc_thread_register(void) {
+    /* The key value must be set for the destructor to be called */
+    pthread_once(&thread_used_memory_once,zmalloc_thread_key_create);
+    pthread_setspecific(thread_used_memory_key,(void*)1);
+    thread_used_memory_registered = 1;
+    __atomic_add_fetch(&zmalloc_threads,1,__ATOMIC_RELAXED);
+}
+
+/* Add the allocations of the calling thread not accounted yet to the total.
+ * This is done automatically when the thread exits. */
+void zmalloc_thread_flush(void) {
+    long long delta = thread_used_memory;
+
+    if (delta == 0) return;
+    thread_used_memory = 0;
+    if (delta > 0)
+        update_zmalloc_stat_add((size_t)delta);
+    else
+        update_zmalloc_stat_sub((size_t)-delta);
+}
+
 static void zmalloc_default_oom(size_t size) {
     fprintf(stderr, "zmalloc: Out of memory trying to allocate %zu bytes\n",
         size);
@@ -190,6 +262,15 @@ size_t zmalloc_size(void *ptr) {
     if (size&(sizeof(long)-1)) size += sizeof(long)-(size&(sizeof(long)-1));
     return size+PREFIX_SIZE;
 }
+
+/* Return the number of bytes the caller can actually use starting at 'ptr'.
+ * Without a malloc_size() this is exactly the size requested to zmalloc():
+ * the padding assumed by zmalloc_size() is not guaranteed. */
+size_t zmalloc_usable_size(void *ptr) {
+    void *realptr = (char*)ptr-PREFIX_SIZE;
+
+    return *((size_t*)realptr);
+}
 #endif
 
 void zfree(void *ptr) {
@@ -210,6 +291,23 @@ void zfree(void *ptr) {
 #endif
 }
 
+/* Allocate 'size' bytes aligned to 'alignment', a power of two multiple of
+ * sizeof(void*). There is no room for the size prefix, so the memory must
+ * be released with zfree_aligned() passing the same size. */
+void *zmalloc_aligned(size_t alignment, size_t size) {
+    void *ptr = NULL;
+
+    if (posix_memalign(&ptr,alignment,size) != 0) zmalloc_oom_handler(size);
+    update_zmalloc_stat_alloc(size);
+    return ptr;
+}
+
+void zfree_aligned(void *ptr, size_t size) {
+    if (ptr == NULL) return;
+    update_zmalloc_stat_free(size);
+    free(ptr);
+}
+
 char *zstrdup(const char *s) {
     size_t l = strlen(s)+1;
     char *p = zmalloc(l);
@@ -218,10 +316,14 @@ char *zstrdup(const char *s) {
     return p;
 }
 
+/* Return the memory allocated. With thread safety enabled the allocations
+ * of the other threads are accounted within zmalloc_stat_batch bytes per
+ * thread, see update_zmalloc_stat_alloc(). */
 size_t zmalloc_used_memory(void) {
     size_t um;
 
     if (zmalloc_thread_safe) {
+        zmalloc_thread_flush();
 #if defined(__ATOMIC_RELAXED) || defined(HAVE_ATOMIC)
         um = update_zmalloc_stat_add(0);
 #else
@@ -229,6 +331,15 @@ size_t zmalloc_used_memory(void) {
         um = used_memory;
         pthread_mutex_unlock(&used_memory_mutex);
 #endif
+        /* Memory freed by a thread and still not flushed by the thread
+         * that allocated it can make the total transiently negative, by
+         * zmalloc_stat_batch bytes per thread at most. More than that
+         * means some allocations were never accounted. */
+        if ((ssize_t)um < 0) {
+            assert(-(ssize_t)um <= __atomic_load_n(&zmalloc_threads,
+                __ATOMIC_RELAXED) * (ssize_t)zmalloc_stat_batch);
+            um = 0;
+        }
     }
     else {
         um = used_memory;
@@ -241,10 +352,135 @@ void zmalloc_enable_thread_safeness(void) {
     zmalloc_thread_safe = 1;
 }
 
+/* Set how many bytes a thread can allocate or free before they are added
+ * to the total returned by zmalloc_used_memory(), 0 to always keep the
+ * total exact. Call it before other threads start allocating. */
+void zmalloc_set_stat_batch(size_t bytes) {
+    zmalloc_stat_batch = bytes;
+}
+
 void zmalloc_set_oom_handler(void (*oom_handler)(size_t)) {
     zmalloc_oom_handler = oom_handler;
 }
 
+/* Per arena allocation. With jemalloc a thread can direct its allocations
+ * to an arena of its own, so threads working on different data don't
+ * contend for the same arena, and the memory of every arena can be
+ * inspected and purged on its own. Allocations of more than a jemalloc
+ * chunk don't belong to any arena. With other allocators there is a single
+ * arena: zmalloc_arena_create() returns ZMALLOC_NO_ARENA and the rest is a
+ * no-op.
+ *
+ * Limits, with the jemalloc 3.x of deps/:
+ * - mallocx() with an explicit arena never uses the thread cache, so every
+ *   allocation from an arena takes the arena lock. Threads allocating from
+ *   different arenas don't contend, but threads sharing one contend more
+ *   than with the thread caches.
+ * - Memory is only freed to its arena if the arena is selected when it is
+ *   freed, otherwise it goes to the thread cache and is reused by whatever
+ *   arena the thread allocates from next: the stats and the purge of an
+ *   arena are only accurate if its memory is always freed with the arena
+ *   selected. */
+#if defined(USE_JEMALLOC)
+int zmalloc_arena_create(void) {
+    unsigned arena;
+    size_t sz = sizeof(arena);
+
+    if (je_mallctl("arenas.extend",&arena,&sz,NULL,0) != 0)
+        return ZMALLOC_NO_ARENA;
+    return (int)arena;
+}
+
+/* Allocate from 'arena' in the calling thread until the next call, or from
+ * the default arena of the thread with ZMALLOC_NO_ARENA. */
+void zmalloc_set_thread_arena(int arena) {
+    thread_arena = arena;
+}
+
+int zmalloc_get_thread_arena(void) {
+    return thread_arena;
+}
+
+/* Fill 'st' with the memory of 'arena'. Returns -1 if not available. */
+int zmalloc_arena_stats(int arena, zmallocArenaStats *st) {
+    uint64_t epoch = 1;
+    size_t sz, small, large, pactive, pdirty, page;
+    char name[64];
+
+    if (arena == ZMALLOC_NO_ARENA) return -1;
+    /* Stats are only refreshed when the epoch is advanced */
+    sz = sizeof(epoch);
+    je_mallctl("epoch",&epoch,&sz,&epoch,sz);
+    sz = sizeof(size_t);
+    if (je_mallctl("arenas.page",&page,&sz,NULL,0) != 0) return -1;
+    snprintf(name,sizeof(name),"stats.arenas.%d.small.allocated",arena);
+    if (je_mallctl(name,&small,&sz,NULL,0) != 0) return -1;
+    snprintf(name,sizeof(name),"stats.arenas.%d.large.allocated",arena);
+    if (je_mallctl(name,&large,&sz,NULL,0) != 0) return -1;
+    snprintf(name,sizeof(name),"stats.arenas.%d.pactive",arena);
+    if (je_mallctl(name,&pactive,&sz,NULL,0) != 0) return -1;
+    snprintf(name,sizeof(name),"stats.arenas.%d.pdirty",arena);
+    if (je_mallctl(name,&pdirty,&sz,NULL,0) != 0) return -1;
+    snprintf(name,sizeof(name),"stats.arenas.%d.mapped",arena);
+    if (je_mallctl(name,&st->mapped,&sz,NULL,0) != 0) return -1;
+    st->allocated = small+large;
+    st->active = pactive*page;
+    st->dirty = pdirty*page;
+    return 0;
+}
+
+/* Return the unused dirty pages of 'arena' to the OS. */
+void zmalloc_arena_purge(int arena) {
+    char name[64];
+
+    if (arena == ZMALLOC_NO_ARENA) return;
+    snprintf(name,sizeof(name),"arena.%d.purge",arena);
+    je_mallctl(name,NULL,NULL,NULL,0);
+}
+
+/* Return the memory cached by the calling thread to the arenas. */
+void zmalloc_thread_tcache_flush(void) {
+    je_mallctl("thread.tcache.flush",NULL,NULL,NULL,0);
+}
+
+/* Enable or disable the cache of the calling thread. Without it every
+ * allocation locks the arena, but no memory is held by the thread. */
+void zmalloc_set_thread_tcache(int enabled) {
+    bool e = enabled != 0;
+
+    je_mallctl("thread.tcache.enabled",NULL,NULL,&e,sizeof(e));
+}
+#else
+int zmalloc_arena_create(void) {
+    return ZMALLOC_NO_ARENA;
+}
+
+void zmalloc_set_thread_arena(int arena) {
+    ((void) arena);
+}
+
+int zmalloc_get_thread_arena(void) {
+    return ZMALLOC_NO_ARENA;
+}
+
+int zmalloc_arena_stats(int arena, zmallocArenaStats *st) {
+    ((void) arena);
+    ((void) st);
+    return -1;
+}
+
+void zmalloc_arena_purge(int arena) {
+    ((void) arena);
+}
+
+void zmalloc_thread_tcache_flush(void) {
+}
+
+void zmalloc_set_thread_tcache(int enabled) {
+    ((void) enabled);
+}
+#endif
+
 /* Get the RSS information in an OS-specific way.
  *
  * WARNING: the function zmalloc_get_rss() is not designed to be fast
@@ -65,13 +65,38 @@
 #define ZMALLOC_LIB "libc"
 #endif
 
+/* Bytes a thread can allocate or free before they are accounted in the
+ * total, see zmalloc_set_stat_batch(). */
+#define ZMALLOC_STAT_BATCH (64*1024)
+
+/* No specific arena, see zmalloc_set_thread_arena(). */
+#define ZMALLOC_NO_ARENA (-1)
+
+typedef struct zmallocArenaStats {
+    size_t allocated; /* Bytes allocated from the arena */
+    size_t active; /* Bytes of the pages in use */
+    size_t dirty; /* Bytes of unused pages not yet returned to the OS */
+    size_t mapped; /* Bytes mapped by the arena */
+} zmallocArenaStats;
+
 void *zmalloc(size_t size);
 void *zcalloc(size_t size);
 void *zrealloc(void *ptr, size_t size);
 void zfree(void *ptr);
+void *zmalloc_aligned(size_t alignment, size_t size);
+void zfree_aligned(void *ptr, size_t size);
 char *zstrdup(const char *s);
 size_t zmalloc_used_memory(void);
 void zmalloc_enable_thread_safeness(void);
+void zmalloc_set_stat_batch(size_t bytes);
+void zmalloc_thread_flush(void);
+int zmalloc_arena_create(void);
+void zmalloc_set_thread_arena(int arena);
+int zmalloc_get_thread_arena(void);
+int zmalloc_arena_stats(int arena, zmallocArenaStats *st);
+void zmalloc_arena_purge(int arena);
+void zmalloc_thread_tcache_flush(void);
+void zmalloc_set_thread_tcache(int enabled);
 void zmalloc_set_oom_handler(void (*oom_handler)(size_t));
 float zmalloc_get_fragmentation_ratio(size_t rss);
 size_t zmalloc_get_rss(void);
@@ -81,6 +106,9 @@ void zlibc_free(void *ptr);
 
 #ifndef HAVE_MALLOC_SIZE
 size_t zmalloc_size(void *ptr);
+size_t zmalloc_usable_size(void *ptr);
+#else
+#define zmalloc_usable_size(p) zmalloc_size(p)
 #endif
 
 #endif /* __ZMALLOC_H */